@@ -0,0 +1,551 @@
+/*
+  Host replay benchmark for lib/VictronCore
+
+  Feeds captured advertisements (see the 'capture' command) through the
+  same stages as the firmware's onResult + processPacket path and reports
+  packets/sec, per-stage latency and heap allocations:
+
+    parse    findVictronManufacturerData() on the raw AD structures
+    lookup   macIndexFind() for Victron advertisements
+    decrypt  victronDecrypt() for new readings of configured devices
+    decode   recordPlausible() + decodeRecord()
+
+  Build and run (needs the host mbedtls, e.g. libmbedtls-dev):
+    pio run -e native
+    .pio/build/native/program [options] [trace]
+
+  trace is either a serial log with FRAME_TYPE_CAPTURE frames ('capture
+  serial' or 'capture dump') or a copy of /capture.bin ('capture flash').
+  Options:
+    --keys <file>       Devices to decrypt, one "<mac> <key> <type>" per
+                        line, as for the 'add' command ('#' comments)
+    --repeat <n>        Replay the trace n times (default 20)
+    --synthetic <n>     No trace: 60 s of a configured solar charger, shunt
+                        and battery sense among n foreign devices
+    --save <file>       Write the synthetic trace in /capture.bin format
+*/
+
+#include <VictronCore.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// ============================================================================
+// Allocation Counting
+// ============================================================================
+// Only counted while `allocCounting` is set: loading the trace allocates,
+// the replay itself must not. operator new covers the C++ side; with
+// BENCH_WRAP_MALLOC (see env:native) the linker also routes every malloc
+// of the benchmark and VictronCore objects through here.
+static bool allocCounting = false;
+static size_t allocCount = 0;
+static size_t allocBytes = 0;
+
+static void countAllocation(size_t size) {
+  if (!allocCounting) return;
+  allocCount++;
+  allocBytes += size;
+}
+
+void* operator new(size_t size) {
+  countAllocation(size);
+  void* p = std::malloc(size ? size : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+#ifdef BENCH_WRAP_MALLOC
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+void __real_free(void* p);
+
+void* __wrap_malloc(size_t size) { countAllocation(size); return __real_malloc(size); }
+void* __wrap_calloc(size_t count, size_t size) { countAllocation(count * size); return __real_calloc(count, size); }
+void* __wrap_realloc(void* p, size_t size) { countAllocation(size); return __real_realloc(p, size); }
+void __wrap_free(void* p) { __real_free(p); }
+}
+#endif
+
+// ============================================================================
+// Trace Loading
+// ============================================================================
+#define FRAME_TYPE_CAPTURE  0x20  // As in src/main.cpp
+#define FRAME_HEADER_SIZE   3     // Type, device index, RSSI
+#define FRAME_CRC_SIZE      2
+
+// Same CRC as the firmware's telemetry frames
+static uint16_t crc16Ccitt(const uint8_t* data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// Returns the decoded length, or 0 if `in` is not valid COBS
+static size_t cobsDecode(const uint8_t* in, size_t len, uint8_t* out, size_t outMax) {
+  size_t outPos = 0;
+  size_t i = 0;
+  while (i < len) {
+    uint8_t code = in[i++];
+    if (code == 0 || i + code - 1 > len) return 0;
+    for (uint8_t k = 1; k < code; k++) {
+      if (outPos >= outMax) return 0;
+      out[outPos++] = in[i++];
+    }
+    if (code != 0xFF && i < len) {
+      if (outPos >= outMax) return 0;
+      out[outPos++] = 0;
+    }
+  }
+  return outPos;
+}
+
+// Serial log: 0x00-delimited COBS frames between text lines. Anything that
+// does not decode to a capture frame with a good CRC is text and skipped.
+static void loadSerialFrames(const std::vector<uint8_t>& file, std::vector<captureRecord>& trace) {
+  uint8_t frame[FRAME_HEADER_SIZE + sizeof(captureRecord) + FRAME_CRC_SIZE];
+  size_t start = 0;
+  for (size_t i = 0; i <= file.size(); i++) {
+    if (i < file.size() && file[i] != 0) continue;
+    size_t len = cobsDecode(&file[start], i - start, frame, sizeof(frame));
+    start = i + 1;
+    if (len < FRAME_HEADER_SIZE + offsetof(captureRecord, payload) + FRAME_CRC_SIZE) continue;
+    uint16_t crc = frame[len - 2] | (frame[len - 1] << 8);
+    if (frame[0] != FRAME_TYPE_CAPTURE || crc16Ccitt(frame, len - FRAME_CRC_SIZE) != crc) continue;
+
+    captureRecord r = {};
+    size_t used = len - FRAME_HEADER_SIZE - FRAME_CRC_SIZE;
+    memcpy(&r, &frame[FRAME_HEADER_SIZE], used);
+    if (r.length > CAPTURE_PAYLOAD_MAX || offsetof(captureRecord, payload) + r.length != used) continue;
+    trace.push_back(r);
+  }
+}
+
+static bool loadTrace(const char* path, std::vector<captureRecord>& trace) {
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return false;
+  }
+  std::vector<uint8_t> file;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) file.insert(file.end(), buffer, buffer + n);
+  fclose(f);
+
+  loadSerialFrames(file, trace);
+  if (trace.empty() && !file.empty() && file.size() % sizeof(captureRecord) == 0) {
+    // No frames: a copy of the flash capture file
+    trace.resize(file.size() / sizeof(captureRecord));
+    memcpy(trace.data(), file.data(), file.size());
+  }
+  printf("trace: %s, %zu advertisements\n", path, trace.size());
+  return !trace.empty();
+}
+
+// ============================================================================
+// Devices
+// ============================================================================
+#define BENCH_MAX_DEVICES      8   // The firmware's MAX_DEVICES
+#define MANUFACTURER_DATA_MAX  31  // As the firmware's rawPacket
+
+struct benchDevice {
+  uint8_t mac[6];
+  uint8_t key[16];
+  bool batterySense;           // Sends battery monitor records under any type byte
+  mbedtls_aes_context aes;
+  bool seen;
+  uint16_t nonce;
+};
+
+static std::vector<benchDevice> devices;
+static macIndexTable macIndex = {};
+
+static bool parseHex(const char* hex, uint8_t* out, size_t bytes) {
+  size_t digits = 0;
+  for (; *hex; hex++) {
+    if (*hex == ':') continue;
+    char c = *hex;
+    int nibble = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+               : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+    if (nibble < 0 || digits >= 2 * bytes) return false;
+    if (digits % 2 == 0) out[digits / 2] = nibble << 4;
+    else out[digits / 2] |= nibble;
+    digits++;
+  }
+  return digits == 2 * bytes;
+}
+
+static bool addDevice(const uint8_t* mac, const uint8_t* key, bool batterySense) {
+  if (devices.size() >= BENCH_MAX_DEVICES) return false;
+  benchDevice d = {};
+  memcpy(d.mac, mac, 6);
+  memcpy(d.key, key, 16);
+  d.batterySense = batterySense;
+  devices.push_back(d);
+  return true;
+}
+
+static bool loadKeys(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (f == nullptr) {
+    fprintf(stderr, "cannot open %s\n", path);
+    return false;
+  }
+  char line[256];
+  int lineNo = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineNo++;
+    char macText[32], keyText[64], typeText[32] = "";
+    if (line[0] == '#' || sscanf(line, "%31s %63s %31s", macText, keyText, typeText) < 2) continue;
+    uint8_t mac[6], key[16];
+    if (!parseHex(macText, mac, 6) || !parseHex(keyText, key, 16)) {
+      fprintf(stderr, "%s:%d: bad MAC or key\n", path, lineNo);
+      continue;
+    }
+    if (!addDevice(mac, key, strcmp(typeText, "BattSense") == 0)) {
+      fprintf(stderr, "%s:%d: more than %d devices\n", path, lineNo, BENCH_MAX_DEVICES);
+      break;
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+static void initDevices() {
+  for (size_t i = 0; i < devices.size(); i++) {
+    victronCipherInit(&devices[i].aes, devices[i].key);
+    macIndexInsert(macIndex, devices[i].mac, (int)i);
+  }
+}
+
+// ============================================================================
+// Synthetic Trace
+// ============================================================================
+// A crowded marina in miniature: each configured device sends a new
+// reading every second and repeats it ~10 times; the foreign devices are
+// phones, beacons and other boats' Victron gear at ~2 adverts/s each.
+#define SYNTHETIC_SECONDS   60
+#define SYNTHETIC_REPEATS   10    // Copies per reading
+#define SYNTHETIC_STEP_MS   50
+
+static uint32_t randomState = 0x2545F491;
+
+static uint32_t nextRandom() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+// Flags AD structure + manufacturer data with `data` after the vendor ID
+static void buildAdvertisement(captureRecord* r, uint16_t vendor, const uint8_t* data, size_t length) {
+  static const uint8_t flags[] = { 0x02, 0x01, 0x06 };
+  memcpy(r->payload, flags, sizeof(flags));
+  size_t pos = sizeof(flags);
+  r->payload[pos++] = 3 + length;            // Type + vendor + data
+  r->payload[pos++] = AD_TYPE_MANUFACTURER_DATA;
+  r->payload[pos++] = vendor & 0xff;
+  r->payload[pos++] = vendor >> 8;
+  memcpy(&r->payload[pos], data, length);
+  r->length = pos + length;
+}
+
+// Encrypted Victron product advertisement; AES-CTR decrypts and encrypts alike
+static void buildVictronAdvertisement(captureRecord* r, mbedtls_aes_context* aes, uint8_t keyByte,
+                                      uint8_t recordType, uint16_t nonce, const uint8_t* record) {
+  victronManufacturerData vic = {};
+  vic.vendorID = 0x02E1;
+  vic.beaconType = VICTRON_BEACON_PRODUCT_ADV;
+  vic.productID = 0xA060;
+  vic.victronRecordType = recordType;
+  vic.nonceDataCounter = nonce;
+  vic.encryptKeyMatch = keyByte;
+  memcpy(vic.victronEncryptedData, record, VICTRON_RECORD_MAX);
+  uint8_t encrypted[RECORD_BUFFER_SIZE];
+  victronDecrypt(aes, &vic, encrypted, VICTRON_RECORD_MAX);
+  memcpy(vic.victronEncryptedData, encrypted, VICTRON_RECORD_MAX);
+  // Trim to the header plus the record, without the vendor ID
+  buildAdvertisement(r, vic.vendorID, (const uint8_t*)&vic + 2, VICTRON_HEADER_SIZE - 2 + VICTRON_RECORD_MAX);
+}
+
+static void buildSyntheticTrace(int foreignCount, std::vector<captureRecord>& trace) {
+  static const uint8_t keys[3][16] = {
+    { 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f },
+    { 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f },
+    { 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f },
+  };
+  static const uint8_t recordTypes[3] = { VICTRON_TYPE_SOLAR_CHARGER, VICTRON_TYPE_BATTERY_MONITOR, VICTRON_TYPE_BATTERY_MONITOR };
+  devices.clear();
+  for (int d = 0; d < 3; d++) {
+    uint8_t mac[6] = { 0xc0, 0xde, 0x00, 0x00, 0x00, (uint8_t)(d + 1) };
+    addDevice(mac, keys[d], d == 2);
+  }
+  initDevices();
+
+  // Solar: state float, 13.45 V, 2.5 A, 1.20 kWh, 120 W, no load output
+  uint8_t solar[VICTRON_RECORD_MAX] = { 5, 0, 0x41, 0x05, 25, 0, 120, 0, 120, 0, 0xff, 0xff };
+  // Monitor: TTG n/a, 13.40 V, no aux, -1.250 A, 12.3 Ah, 87.5 %
+  uint8_t monitor[VICTRON_RECORD_MAX] = { 0xff, 0xff, 0x3c, 0x05, 0, 0, 0, 0, 0x03, 0x1e, 0xfb, 0x7b, 0x00, 0x6b, 0x0d, 0xff };
+
+  for (uint32_t t = 0; t < SYNTHETIC_SECONDS * 1000; t += SYNTHETIC_STEP_MS) {
+    for (int d = 0; d < 3; d++) {
+      // Staggered, so the devices do not all land in the same step
+      if ((t + d * SYNTHETIC_STEP_MS) % (1000 / SYNTHETIC_REPEATS) != 0) continue;
+      captureRecord r = {};
+      r.timeMs = t;
+      memcpy(r.mac, devices[d].mac, 6);
+      r.rssi = -60 - d * 8 - (int)(nextRandom() % 6);
+      buildVictronAdvertisement(&r, &devices[d].aes, devices[d].key[0], recordTypes[d],
+                                (uint16_t)(t / 1000), recordTypes[d] == VICTRON_TYPE_SOLAR_CHARGER ? solar : monitor);
+      trace.push_back(r);
+    }
+    // 2 adverts/s per foreign device: foreignCount / 10 per 50 ms step
+    int burst = foreignCount / 10 + ((int)(nextRandom() % 10) < foreignCount % 10 ? 1 : 0);
+    for (int k = 0; k < burst; k++) {
+      uint32_t id = nextRandom() % foreignCount;
+      captureRecord r = {};
+      r.timeMs = t;
+      uint8_t mac[6] = { 0x5a, (uint8_t)(id >> 16), (uint8_t)(id >> 8), (uint8_t)id, 0x42, 0x17 };
+      memcpy(r.mac, mac, 6);
+      r.rssi = -70 - (int)(nextRandom() % 25);
+      uint8_t data[VICTRON_RECORD_MAX + VICTRON_HEADER_SIZE];
+      for (uint8_t& b : data) b = nextRandom();
+      if (id % 4 == 0) {
+        // Another boat's Victron gear: right vendor, key we do not have
+        mbedtls_aes_context aes;
+        victronCipherInit(&aes, data);
+        buildVictronAdvertisement(&r, &aes, data[0], VICTRON_TYPE_SOLAR_CHARGER, (uint16_t)(t / 1000), data);
+        mbedtls_aes_free(&aes);
+      } else {
+        buildAdvertisement(&r, 0x004C, data, 4 + id % 20);  // Phones, beacons
+      }
+      trace.push_back(r);
+    }
+  }
+  printf("trace: synthetic, %d s, 3 devices + %d foreign, %zu advertisements\n",
+         SYNTHETIC_SECONDS, foreignCount, trace.size());
+}
+
+static bool saveTrace(const char* path, const std::vector<captureRecord>& trace) {
+  FILE* f = fopen(path, "wb");
+  if (f == nullptr || fwrite(trace.data(), sizeof(captureRecord), trace.size(), f) != trace.size()) {
+    fprintf(stderr, "cannot write %s\n", path);
+    if (f) fclose(f);
+    return false;
+  }
+  fclose(f);
+  printf("saved %s\n", path);
+  return true;
+}
+
+// ============================================================================
+// Replay
+// ============================================================================
+enum Stage { STAGE_PARSE, STAGE_LOOKUP, STAGE_DECRYPT, STAGE_DECODE, STAGE_COUNT };
+const char* const stageNames[] = { "parse", "lookup", "decrypt", "decode" };
+
+#define LATENCY_BUCKETS  20000   // 1 ns each, the last one collects the rest
+
+struct stageStats {
+  uint64_t count;
+  uint64_t totalNs;
+  uint32_t maxNs;
+  uint32_t buckets[LATENCY_BUCKETS];
+};
+
+struct replayCounts {
+  uint64_t adverts;
+  uint64_t victron;
+  uint64_t foreign;            // Victron, MAC not configured
+  uint64_t repeats;            // Same nonce as the last decoded reading
+  uint64_t keyMismatches;
+  uint64_t decoded;
+  uint64_t rejected;           // Unknown layout or failed sanity check
+};
+
+static stageStats stages[STAGE_COUNT];
+static replayCounts counts;
+static uint32_t clockOverheadNs = 0;
+
+typedef std::chrono::steady_clock benchClock;
+
+static inline void record(Stage stage, benchClock::time_point start) {
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now() - start).count();
+  ns = ns > clockOverheadNs ? ns - clockOverheadNs : 0;
+  stageStats& s = stages[stage];
+  s.count++;
+  s.totalNs += ns;
+  if (ns > s.maxNs) s.maxNs = (uint32_t)ns;
+  s.buckets[ns < LATENCY_BUCKETS ? ns : LATENCY_BUCKETS - 1]++;
+}
+
+// Smallest back-to-back clock reading, subtracted from every sample
+static void calibrateClock() {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 10000; i++) {
+    benchClock::time_point a = benchClock::now();
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now() - a).count();
+    if (ns < best) best = ns;
+  }
+  clockOverheadNs = (uint32_t)best;
+}
+
+// One advertisement through the firmware's stages. With `timed` every
+// stage is clocked; without, the loop runs flat out for packets/sec and
+// the outcome counters are kept.
+template <bool timed>
+static void replayOne(const captureRecord& r) {
+  benchClock::time_point start;
+  if (timed) start = benchClock::now();
+  int manDataSize;
+  const uint8_t* manData = findVictronManufacturerData(r.payload, r.length, &manDataSize);
+  if (timed) record(STAGE_PARSE, start);
+  if (!timed) counts.adverts++;
+  if (manData == nullptr) return;
+  if (!timed) counts.victron++;
+
+  if (timed) start = benchClock::now();
+  int deviceIndex = macIndexFind(&macIndex, r.mac);
+  if (timed) record(STAGE_LOOKUP, start);
+  if (deviceIndex == -1) {
+    if (!timed) counts.foreign++;
+    return;
+  }
+
+  // As onResult + processPacket(): copy into a padded buffer, skip repeats
+  uint8_t data[MANUFACTURER_DATA_MAX + 1] = {};
+  if (manDataSize > MANUFACTURER_DATA_MAX) manDataSize = MANUFACTURER_DATA_MAX;
+  memcpy(data, manData, manDataSize);
+  const victronManufacturerData* vic = (const victronManufacturerData*)data;
+  benchDevice& d = devices[deviceIndex];
+  if (d.seen && d.nonce == vic->nonceDataCounter) {
+    if (!timed) counts.repeats++;
+    return;
+  }
+  if (vic->encryptKeyMatch != d.key[0]) {
+    if (!timed) counts.keyMismatches++;
+    return;
+  }
+
+  uint8_t output[RECORD_BUFFER_SIZE] = {};
+  if (timed) start = benchClock::now();
+  bool decrypted = victronDecrypt(&d.aes, vic, output, manDataSize - VICTRON_HEADER_SIZE);
+  if (timed) record(STAGE_DECRYPT, start);
+  if (!decrypted) return;
+
+  if (timed) start = benchClock::now();
+  uint8_t recordType = d.batterySense ? VICTRON_TYPE_BATTERY_MONITOR : vic->victronRecordType;
+  const recordLayout* layout = findRecordLayout(recordType);
+  int32_t values[RECORD_FIELDS_MAX];
+  bool ok = layout != nullptr && recordPlausible(output, layout);
+  if (ok) decodeRecord(output, layout, values);
+  if (timed) record(STAGE_DECODE, start);
+  if (!ok) {
+    if (!timed) counts.rejected++;
+    return;
+  }
+  d.seen = true;
+  d.nonce = vic->nonceDataCounter;
+  if (!timed) counts.decoded++;
+}
+
+static uint32_t percentile(const stageStats& s, double fraction) {
+  uint64_t target = (uint64_t)(s.count * fraction);
+  uint64_t seen = 0;
+  for (uint32_t ns = 0; ns < LATENCY_BUCKETS; ns++) {
+    seen += s.buckets[ns];
+    if (seen > target) return ns;
+  }
+  return LATENCY_BUCKETS;
+}
+
+static void resetDedup() {
+  for (benchDevice& d : devices) d.seen = false;
+}
+
+int main(int argc, char** argv) {
+  const char* tracePath = nullptr;
+  const char* keysPath = nullptr;
+  const char* savePath = nullptr;
+  int repeat = 20;
+  int synthetic = -1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) keysPath = argv[++i];
+    else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) repeat = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--synthetic") == 0 && i + 1 < argc) synthetic = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) savePath = argv[++i];
+    else if (argv[i][0] != '-') tracePath = argv[i];
+    else {
+      fprintf(stderr, "usage: %s [--keys file] [--repeat n] [--synthetic n [--save file]] [trace]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (repeat < 1) repeat = 1;
+
+  std::vector<captureRecord> trace;
+  if (synthetic >= 0 || tracePath == nullptr) {
+    buildSyntheticTrace(synthetic > 0 ? synthetic : 300, trace);
+    if (savePath && !saveTrace(savePath, trace)) return 1;
+  } else {
+    if (keysPath && !loadKeys(keysPath)) return 1;
+    initDevices();
+    if (!loadTrace(tracePath, trace)) return 1;
+  }
+  printf("devices: %zu configured, %d passes\n\n", devices.size(), repeat);
+  calibrateClock();
+
+  // Throughput: every stage, no clocks in the loop
+  allocCounting = true;
+  benchClock::time_point start = benchClock::now();
+  for (int pass = 0; pass < repeat; pass++) {
+    resetDedup();
+    for (const captureRecord& r : trace) replayOne<false>(r);
+  }
+  double seconds = std::chrono::duration<double>(benchClock::now() - start).count();
+  // Latency: the same passes again, every stage clocked
+  for (int pass = 0; pass < repeat; pass++) {
+    resetDedup();
+    for (const captureRecord& r : trace) replayOne<true>(r);
+  }
+  allocCounting = false;
+
+  uint64_t adverts = counts.adverts;
+  printf("throughput: %.0f packets/s (%.1f ns per advertisement)\n", adverts / seconds, seconds * 1e9 / adverts);
+  printf("per pass:   %llu adverts, %llu Victron, %llu foreign, %llu repeats, %llu decoded, "
+         "%llu key mismatches, %llu rejected\n\n",
+         (unsigned long long)(adverts / repeat), (unsigned long long)(counts.victron / repeat),
+         (unsigned long long)(counts.foreign / repeat), (unsigned long long)(counts.repeats / repeat),
+         (unsigned long long)(counts.decoded / repeat), (unsigned long long)(counts.keyMismatches / repeat),
+         (unsigned long long)(counts.rejected / repeat));
+
+  printf("stage      samples    avg ns  p50 ns  p99 ns  max ns\n");
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const stageStats& s = stages[i];
+    if (s.count == 0) {
+      printf("%-8s %9d         -       -       -       -\n", stageNames[i], 0);
+      continue;
+    }
+    printf("%-8s %9llu %9.1f %7u %7u %7u\n", stageNames[i], (unsigned long long)s.count,
+           (double)s.totalNs / s.count, percentile(s, 0.5), percentile(s, 0.99), s.maxNs);
+  }
+  printf("(clock overhead %u ns subtracted)\n\n", clockOverheadNs);
+
+  printf("allocations during replay: %zu (%zu bytes)\n", allocCount, allocBytes);
+  return allocCount == 0 ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+#include "VictronCore.h"
+
+#include <string.h>
+
+// ============================================================================
+// Record Layouts
+// ============================================================================
+// Solar charger (0x01)
+constexpr fieldDescriptor solarFields[] = {
+  {   0,  8, false, true,  0xFF,          0, 0, "",    "state"   },
+  {   8,  8, false, true,  0xFF,          0, 0, "",    "error"   },
+  {  16, 16, true,  true,  0x7FFF,        0, 2, "V",   "battV"   },
+  {  32, 16, true,  true,  0x7FFF,        0, 1, "A",   "battI"   },
+  {  48, 16, false, true,  0xFFFF,        0, 2, "kWh", "yield"   },
+  {  64, 16, false, true,  0xFFFF,        0, 0, "W",   "pv"      },
+  {  80,  9, false, true,  0x1FF,         0, 1, "A",   "load"    },
+};
+
+// Battery monitor (0x02) - SmartShunt and Smart Battery Sense
+constexpr fieldDescriptor batteryMonitorFields[] = {
+  {   0, 16, false, true,  0xFFFF,        0, 0, "min", "ttg"     },
+  {  16, 16, true,  true,  0x7FFF,        0, 2, "V",   "battV"   },
+  {  32, 16, false, false, 0,             0, 0, "",    "alarm"   },
+  {  48, 16, false, true,  0xFFFF,        0, 2, "",    "aux"     },  // V or K, see aux input
+  {  64,  2, false, false, 0,             0, 0, "",    "auxIn"   },
+  {  66, 22, true,  true,  0x1FFFFF,      0, 3, "A",   "battI"   },
+  {  88, 20, false, true,  0xFFFFF,       0, 1, "Ah",  "used"    },  // Consumed, shown as -Ah
+  { 108, 10, false, true,  0x3FF,         0, 1, "%",   "soc"     },
+};
+
+// Inverter (0x03)
+constexpr fieldDescriptor inverterFields[] = {
+  {   0,  8, false, true,  0xFF,          0, 0, "",    "state"   },
+  {   8, 16, false, true,  0xFFFF,        0, 0, "",    "alarm"   },
+  {  24, 16, true,  true,  0x7FFF,        0, 2, "V",   "battV"   },
+  {  40, 16, false, true,  0xFFFF,        0, 0, "VA",  "acS"     },
+  {  56, 15, false, true,  0x7FFF,        0, 2, "V",   "acV"     },
+  {  71, 11, false, true,  0x7FF,         0, 1, "A",   "acI"     },
+};
+
+// DC/DC converter (0x04)
+constexpr fieldDescriptor dcdcFields[] = {
+  {   0,  8, false, true,  0xFF,          0, 0, "",    "state"   },
+  {   8,  8, false, true,  0xFF,          0, 0, "",    "error"   },
+  {  16, 16, false, true,  0xFFFF,        0, 2, "V",   "inV"     },
+  {  32, 16, true,  true,  0x7FFF,        0, 2, "V",   "outV"    },
+  {  48, 32, false, true,  0xFFFFFFFF,    0, 0, "",    "offWhy"  },
+};
+
+// Smart Lithium battery (0x05)
+constexpr fieldDescriptor smartLithiumFields[] = {
+  {   0, 32, false, false, 0,             0, 0, "",    "flags"   },
+  {  32, 16, false, false, 0,             0, 0, "",    "error"   },
+  {  48,  7, false, true,  0x7F,        260, 2, "V",   "c1"      },
+  {  55,  7, false, true,  0x7F,        260, 2, "V",   "c2"      },
+  {  62,  7, false, true,  0x7F,        260, 2, "V",   "c3"      },
+  {  69,  7, false, true,  0x7F,        260, 2, "V",   "c4"      },
+  {  76,  7, false, true,  0x7F,        260, 2, "V",   "c5"      },
+  {  83,  7, false, true,  0x7F,        260, 2, "V",   "c6"      },
+  {  90,  7, false, true,  0x7F,        260, 2, "V",   "c7"      },
+  {  97, 12, false, true,  0xFFF,         0, 2, "V",   "battV"   },
+  { 109,  4, false, true,  0xF,           0, 0, "",    "balance" },
+  { 113,  7, false, true,  0x7F,        -40, 0, "C",   "temp"    },
+};
+
+#define LAYOUT(type, tag, fields, reservedOffset, reservedWidth) \
+  { type, tag, fields, sizeof(fields) / sizeof(fields[0]), reservedOffset, reservedWidth }
+constexpr recordLayout recordLayouts[] = {
+  // Solar: bits 89..95, after the 9-bit load current, are unused
+  LAYOUT(VICTRON_TYPE_SOLAR_CHARGER,   "SOLAR",    solarFields,          89, 7),
+  LAYOUT(VICTRON_TYPE_BATTERY_MONITOR, "SHUNT",    batteryMonitorFields,  0, 0),
+  LAYOUT(VICTRON_TYPE_INVERTER,        "INVERTER", inverterFields,        0, 0),
+  LAYOUT(VICTRON_TYPE_DCDC_CONVERTER,  "DCDC",     dcdcFields,            0, 0),
+  LAYOUT(VICTRON_TYPE_SMART_LITHIUM,   "LITHIUM",  smartLithiumFields,    0, 0),
+};
+#undef LAYOUT
+const int recordLayoutCount = sizeof(recordLayouts) / sizeof(recordLayouts[0]);
+
+static_assert(sizeof(solarFields) / sizeof(solarFields[0]) == SOLAR_FIELD_COUNT, "solar layout");
+static_assert(sizeof(batteryMonitorFields) / sizeof(batteryMonitorFields[0]) == MONITOR_FIELD_COUNT, "monitor layout");
+static_assert(sizeof(smartLithiumFields) / sizeof(smartLithiumFields[0]) <= RECORD_FIELDS_MAX, "too many fields");
+
+const recordLayout* findRecordLayout(uint8_t recordType) {
+  for (const recordLayout& layout : recordLayouts) {
+    if (layout.recordType == recordType) return &layout;
+  }
+  return nullptr;
+}
+
+static uint32_t extractBits(const uint8_t* data, uint8_t offset, uint8_t width) {
+  const uint8_t* p = data + (offset >> 3);
+  // 5 bytes cover any 32-bit field at any bit position
+  uint64_t window = (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+                    ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32);
+  return (uint32_t)(window >> (offset & 7)) & (uint32_t)((1ULL << width) - 1);
+}
+
+bool recordPlausible(const uint8_t* data, const recordLayout* layout) {
+  if (layout->reservedWidth == 0) return true;
+  uint32_t ones = (uint32_t)((1ULL << layout->reservedWidth) - 1);
+  return extractBits(data, layout->reservedOffset, layout->reservedWidth) == ones;
+}
+
+uint32_t decodeRecord(const uint8_t* data, const recordLayout* layout, int32_t* values) {
+  uint32_t validMask = 0;
+  for (uint8_t i = 0; i < layout->fieldCount; i++) {
+    const fieldDescriptor& f = layout->fields[i];
+    uint32_t raw = extractBits(data, f.offset, f.width);
+    uint32_t signBit = (uint32_t)f.isSigned << (f.width - 1);
+    values[i] = (int32_t)((raw ^ signBit) - signBit) + f.bias;
+    validMask |= (uint32_t)(!f.hasNa || raw != f.na) << i;
+  }
+  return validMask;
+}
+
+
+// ============================================================================
+// Advertisement
+// ============================================================================
+const uint8_t* findVictronManufacturerData(const uint8_t* payload, size_t payloadLength, int* dataLength) {
+  size_t pos = 0;
+  while (pos + 1 < payloadLength) {
+    uint8_t adLength = payload[pos];                 // Type byte + data
+    if (adLength == 0 || pos + 1 + adLength > payloadLength) return nullptr;
+    const uint8_t* ad = &payload[pos + 1];
+    if (ad[0] == AD_TYPE_MANUFACTURER_DATA && adLength >= 4 &&
+        ad[1] == VICTRON_VENDOR_ID_LO && ad[2] == VICTRON_VENDOR_ID_HI &&
+        ad[3] == VICTRON_BEACON_PRODUCT_ADV) {
+      *dataLength = adLength - 1;
+      return &ad[1];
+    }
+    pos += 1 + adLength;
+  }
+  return nullptr;
+}
+
+// ============================================================================
+// Decryption
+// ============================================================================
+bool victronCipherInit(mbedtls_aes_context* ctx, const uint8_t* key) {
+  mbedtls_aes_init(ctx);
+  if (mbedtls_aes_setkey_enc(ctx, key, AES_KEY_BITS) != 0) {
+    mbedtls_aes_free(ctx);
+    return false;
+  }
+  return true;
+}
+
+bool victronDecrypt(mbedtls_aes_context* ctx, const victronManufacturerData* vicData, uint8_t* output, int dataSize) {
+  if (dataSize <= 0) return false;
+  if (dataSize > VICTRON_RECORD_MAX) dataSize = VICTRON_RECORD_MAX;
+  
+  // Only the nonce changes per packet
+  uint8_t nonceCounter[16] = { (uint8_t)(vicData->nonceDataCounter & 0xff), (uint8_t)(vicData->nonceDataCounter >> 8), 0 };
+  uint8_t streamBlock[16] = { 0 };
+  size_t nonceOffset = 0;
+  
+  return mbedtls_aes_crypt_ctr(ctx, dataSize, &nonceOffset, nonceCounter, streamBlock,
+                               vicData->victronEncryptedData, output) == 0;
+}
+
+// ============================================================================
+// MAC Index
+// ============================================================================
+int macIndexFind(const macIndexTable* index, const uint8_t* mac) {
+  uint64_t key = packMac(mac);
+  uint32_t slot = macHash(key) & (MAC_INDEX_SIZE - 1);
+  for (int probe = 0; probe < MAC_INDEX_SIZE; probe++) {
+    if (index->key[slot] == key) return index->deviceIndex[slot];
+    if (index->key[slot] == 0) return -1;
+    slot = (slot + 1) & (MAC_INDEX_SIZE - 1);
+  }
+  return -1;
+}
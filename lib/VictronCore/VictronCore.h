@@ -0,0 +1,176 @@
+/*
+  Victron BLE decode core
+
+  Everything between a raw advertisement and decoded field values: finding
+  the Victron manufacturer data, the MAC index, AES-CTR decryption and the
+  record layouts. Depends only on the C library and mbedtls (hardware AES on
+  the ESP32), so it builds for any target.
+
+  Based on Victron BLE Advertising protocol:
+    https://community.victronenergy.com/storage/attachments/48745-extra-manufacturer-data-2022-12-14.pdf
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mbedtls/aes.h>
+
+// ============================================================================
+// Victron Record Types
+// ============================================================================
+#define VICTRON_TYPE_SOLAR_CHARGER    0x01
+#define VICTRON_TYPE_BATTERY_MONITOR  0x02  // Smart Shunt
+#define VICTRON_TYPE_INVERTER         0x03
+#define VICTRON_TYPE_DCDC_CONVERTER   0x04
+#define VICTRON_TYPE_SMART_LITHIUM    0x05
+
+// ============================================================================
+// Data Structures for Different Device Types
+// ============================================================================
+
+// Product IDs for Battery Sense
+#define PRODUCT_ID_BATTERY_SENSE_1  0xA3A4
+#define PRODUCT_ID_BATTERY_SENSE_2  0xA3A5
+#define IS_BATTERY_SENSE(pid) ((pid) == PRODUCT_ID_BATTERY_SENSE_1 || (pid) == PRODUCT_ID_BATTERY_SENSE_2)
+
+// Manufacturer data header (common to all Victron devices)
+typedef struct {
+  uint16_t vendorID;         // 0x02E1 = Victron
+  uint8_t beaconType;        // 0x10 = Product Advertisement
+  uint16_t productID;        // Product identifier (e.g., 0xA3A4 = Battery Sense)
+  uint8_t dataCounter;       // Record counter
+  uint8_t victronRecordType; // 0x01=Solar, 0x02=Battery Monitor, etc.
+  uint16_t nonceDataCounter; // Nonce for decryption
+  uint8_t encryptKeyMatch;   // Should match first byte of encryption key
+  uint8_t victronEncryptedData[21];
+  uint8_t nullPad;
+} __attribute__((packed)) victronManufacturerData;
+
+// ============================================================================
+// Record Layouts
+// ============================================================================
+// Every record type is a constexpr table of bit fields, decoded by the same
+// loop (decodeRecord). Values stay in the protocol's integer units; `decimals`
+// and `unit` describe them for the text/telemetry edges only.
+#define VICTRON_RECORD_MAX      16    // Decrypted bytes per record
+#define RECORD_BUFFER_SIZE      (VICTRON_RECORD_MAX + 8)  // Slack for 5-byte field loads
+#define RECORD_FIELDS_MAX       16
+
+typedef struct {
+  uint8_t offset;            // First bit, LSB-first from the start of the record
+  uint8_t width;             // Bits, 1..32
+  bool isSigned;             // Two's complement of `width` bits
+  bool hasNa;                // The field has a "not available" value...
+  uint32_t na;               // ...this raw one (any 32-bit value can be real data)
+  int16_t bias;              // Added after sign extension (e.g. cell 0 = 2.60V)
+  int8_t decimals;           // Value is in units of 10^-decimals `unit`
+  const char* unit;
+  const char* name;
+} fieldDescriptor;
+
+typedef struct {
+  uint8_t recordType;
+  const char* tag;           // Log prefix
+  const fieldDescriptor* fields;
+  uint8_t fieldCount;
+  uint8_t reservedOffset;    // Unused bits the device sends as all ones...
+  uint8_t reservedWidth;     // ...0 = no check
+} recordLayout;
+
+// Solar charger (0x01)
+enum { SOLAR_STATE, SOLAR_ERROR, SOLAR_BATTERY_VOLTAGE, SOLAR_BATTERY_CURRENT,
+       SOLAR_YIELD_TODAY, SOLAR_PV_POWER, SOLAR_LOAD_CURRENT, SOLAR_FIELD_COUNT };
+
+// Battery monitor (0x02) - SmartShunt and Smart Battery Sense
+enum { MONITOR_TTG, MONITOR_BATTERY_VOLTAGE, MONITOR_ALARM, MONITOR_AUX_VALUE, MONITOR_AUX_INPUT,
+       MONITOR_BATTERY_CURRENT, MONITOR_CONSUMED_AH, MONITOR_SOC, MONITOR_FIELD_COUNT };
+#define AUX_INPUT_TEMPERATURE   2     // aux value is 0.01K
+
+extern const recordLayout recordLayouts[];
+extern const int recordLayoutCount;
+
+const recordLayout* findRecordLayout(uint8_t recordType);
+
+// Decode all fields of one record. `data` must hold RECORD_BUFFER_SIZE bytes
+// (zero padded). Returns a bit mask of the fields that are not N/A.
+uint32_t decodeRecord(const uint8_t* data, const recordLayout* layout, int32_t* values);
+
+// Sanity check before decoding: a record decrypted with the wrong key, or
+// garbage, has random unused bits. `data` as for decodeRecord.
+bool recordPlausible(const uint8_t* data, const recordLayout* layout);
+
+// ============================================================================
+// Advertisement
+// ============================================================================
+#define AD_TYPE_MANUFACTURER_DATA   0xFF
+#define VICTRON_VENDOR_ID_LO        0xE1  // 0x02E1, little endian
+#define VICTRON_VENDOR_ID_HI        0x02
+#define VICTRON_BEACON_PRODUCT_ADV  0x10
+#define VICTRON_HEADER_SIZE         10    // Bytes before the encrypted record
+
+// Walk the raw AD structures looking for a Victron product advertisement.
+// Returns the manufacturer data (starting at the vendor ID), or nullptr.
+const uint8_t* findVictronManufacturerData(const uint8_t* payload, size_t payloadLength, int* dataLength);
+
+// ============================================================================
+// Decryption
+// ============================================================================
+#define AES_KEY_BITS 128
+
+// Expand the key once; the context is reused for every packet of the device
+bool victronCipherInit(mbedtls_aes_context* ctx, const uint8_t* key);
+
+// AES-CTR with the advertisement's nonce. Decrypts up to VICTRON_RECORD_MAX
+// bytes into `output`.
+bool victronDecrypt(mbedtls_aes_context* ctx, const victronManufacturerData* vicData, uint8_t* output, int dataSize);
+
+// ============================================================================
+// MAC Index
+// ============================================================================
+// Open addressing on the packed 48-bit MAC. constexpr, so a table for a
+// compiled-in device list can be built by the compiler.
+#define MAC_INDEX_SIZE        16    // Power of two, >= 2x configured devices
+
+struct macIndexTable {
+  uint64_t key[MAC_INDEX_SIZE];     // Packed MAC, 0 = empty slot
+  int8_t deviceIndex[MAC_INDEX_SIZE];
+};
+
+constexpr uint64_t packMac(const uint8_t* mac) {
+  return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) | ((uint64_t)mac[2] << 24) |
+         ((uint64_t)mac[3] << 16) | ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+}
+
+constexpr uint32_t macHash(uint64_t key) {
+  // Fibonacci hashing: the vendor prefix is shared, so mix all 48 bits
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 40);
+}
+
+constexpr void macIndexInsert(macIndexTable& index, const uint8_t* mac, int deviceIndex) {
+  uint64_t key = packMac(mac);
+  uint32_t slot = macHash(key) & (MAC_INDEX_SIZE - 1);
+  while (index.key[slot] != 0 && index.key[slot] != key) {
+    slot = (slot + 1) & (MAC_INDEX_SIZE - 1);
+  }
+  index.key[slot] = key;
+  index.deviceIndex[slot] = deviceIndex;
+}
+
+// Device index, or -1
+int macIndexFind(const macIndexTable* index, const uint8_t* mac);
+
+// ============================================================================
+// Capture Records
+// ============================================================================
+// One advertisement as the firmware's 'capture' command records it: fixed
+// size on flash, cut after `length` payload bytes in telemetry frames.
+// bench/replay.cpp reads both.
+#define CAPTURE_PAYLOAD_MAX   62    // Advertisement + scan response
+
+typedef struct __attribute__((packed)) {
+  uint32_t timeMs;                  // millis() at onResult
+  uint8_t mac[6];                   // As reported by the stack (BLEAddress native order)
+  int8_t rssi;
+  uint8_t length;                   // Bytes used in payload
+  uint8_t payload[CAPTURE_PAYLOAD_MAX];  // Raw AD structures
+} captureRecord;
@@ -14,7 +14,25 @@
 #include <BLEDevice.h>
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
-#include <aes/esp_aes.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#if MQTT_BRIDGE
+  #include <WiFi.h>
+  #include <PubSubClient.h>
+  #include <esp_coexist.h>
+#endif
+#if MESH_ROLE
+  #include <WiFi.h>
+  #include <esp_now.h>
+  #include <esp_wifi.h>
+  #include <esp_coexist.h>
+#endif
+#include <atomic>
+#include <VictronCore.h>
+#include <freertos/timers.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <soc/cpu.h>
 
 // Board selection
 #if defined M5STICKC
@@ -42,6 +60,26 @@
   #define COLOR_SOC_MED                 TFT_YELLOW
   #define COLOR_SOC_LOW                 TFT_RED
   #define COLOR_TEMP                    TFT_ORANGE
+  #define COLOR_CHART_LINE              TFT_WHITE
+  #define COLOR_CHART_RANGE             TFT_DARKGREEN
+  #define COLOR_STALE                   TFT_DARKGREY
+
+  // Text grid: font 1 is 6x8 px, scaled so both panels fit 13 columns x 5 rows
+  #if defined M5STICKC
+    #define DISPLAY_TEXT_SIZE           2
+  #else
+    #define DISPLAY_TEXT_SIZE           3
+  #endif
+  #define DISPLAY_CHAR_W                (6 * DISPLAY_TEXT_SIZE)
+  #define DISPLAY_CHAR_H                (8 * DISPLAY_TEXT_SIZE)
+  #define DISPLAY_COLS                  13
+
+  // Off-screen frame buffer: 0 = draw straight to the panel, 8 or 16 = compose
+  // each frame in a sprite of this colour depth and push it in one transaction.
+  // RAM cost is width*height*bpp/8 (set per board in platformio.ini).
+  #ifndef DISPLAY_SPRITE_BPP
+    #define DISPLAY_SPRITE_BPP          0
+  #endif
 
   #define BUTTON_1 37
   #define BUTTON_2 39  // Side button on M5StickC Plus
@@ -49,63 +87,149 @@
 
 BLEScan *pBLEScan;
 
-#define AES_KEY_BITS 128
-int scanTime = 1;
+// Continuous scanning: duration 0 never expires and, with duplicates enabled,
+// every advertisement is reported without being cached in BLEScanResults.
+#define SCAN_DURATION_FOREVER 0
+#define LOOP_POLL_MS          20    // Housekeeping poll period
 
-// ============================================================================
-// Victron Record Types
-// ============================================================================
-#define VICTRON_TYPE_SOLAR_CHARGER    0x01
-#define VICTRON_TYPE_BATTERY_MONITOR  0x02  // Smart Shunt
-#define VICTRON_TYPE_INVERTER         0x03
-#define VICTRON_TYPE_DCDC_CONVERTER   0x04
-#define VICTRON_TYPE_SMART_LITHIUM    0x05
+// Scan scheduler: with SCAN_ADAPTIVE the radio only listens around the
+// learned update times of the known devices. Victron data is in the
+// advertisement itself, so SCAN_ACTIVE 0 (no scan requests) loses nothing.
+#ifndef SCAN_ADAPTIVE
+  #define SCAN_ADAPTIVE       1
+#endif
+#ifndef SCAN_ACTIVE
+  #define SCAN_ACTIVE         1
+#endif
+#define SCAN_SYNC_UPDATES     4     // Period estimates per device before windows start
+#define SCAN_GUARD_MS         150   // Window opens this early
+#define SCAN_WINDOW_MAX_MS    1500  // Then a device that has not reported is missed
+#define SCAN_MAX_MISSES       2     // In a row before going back to continuous
+#define SCAN_MIN_IDLE_MS      300   // Shorter gaps are not worth a stop/start
+#define SCAN_OFFLINE_MS       60000 // Devices silent this long are not waited for
+#define SCAN_SEARCH_EVERY_MS  60000 // A continuous search for silent devices...
+#define SCAN_SEARCH_MS        3000  // ...this long
+#define SCAN_LOSS_MAX_PERMILLE 300  // Lossier devices are not left to windows
+#define SCAN_INTERVAL_MS      100
+#define SCAN_WINDOW_MS        99    // Listening almost all of each interval
+#define SCAN_WINDOW_COEX_MS   70    // With Wi-Fi up (MQTT bridge, mesh): Wi-Fi gets the rest
 
-// ============================================================================
-// Data Structures for Different Device Types
-// ============================================================================
+// Worker task: decrypt, decode and render off the BLE callback
+#define WORKER_CORE           1     // APP_CPU - Bluedroid runs on PRO_CPU (0)
+#define WORKER_PRIORITY       2
+#define WORKER_STACK_SIZE     4096
+#define WORKER_IDLE_MS        500   // Wake up at least this often to report drops
 
-// Solar Charger (SmartSolar MPPT)
-typedef struct {
-  uint8_t deviceState;
-  uint8_t errorCode;
-  int16_t batteryVoltage;    // 0.01V
-  int16_t batteryCurrent;    // 0.1A
-  uint16_t todayYield;       // 0.01kWh
-  uint16_t inputPower;       // W
-  uint8_t outputCurrentLo;
-  uint8_t outputCurrentHi;
-  uint8_t unused[4];
-} __attribute__((packed)) victronSolarData;
+// Link quality: a device silent for DEVICE_STALE_MS has its values greyed out
+#ifndef DEVICE_STALE_MS
+  #define DEVICE_STALE_MS     30000
+#endif
+#define LINK_LOSS_WINDOW      256   // Readings; the loss counters halve at this total
+#define LINK_NONCE_GAP_MAX    64    // A larger jump is a restart, not lost readings
+#define LINK_NONCE_BEHIND_MAX 8     // Older readings, late through the mesh: repeats
 
-// Battery Monitor (Smart Shunt AND Smart Battery Sense - record type 0x02)
-// Smart Battery Sense ha product_id 0xA3A4 o 0xA3A5
-typedef struct {
-  uint16_t ttg;              // Time to go in minutes (0xFFFF = N/A)
-  int16_t batteryVoltage;    // 0.01V
-  uint16_t alarm;            // Alarm reason
-  int16_t auxValue;          // Temperature in Kelvin*100 (if aux_input=2) or aux voltage
-  // Packed bits: aux_input(2) + current(22) + consumed_ah(20) + soc(10) = 54 bits
-  uint8_t packedData[7];     // Remaining packed data
-} __attribute__((packed)) victronBatteryMonitorData;
-
-// Product IDs for Battery Sense
-#define PRODUCT_ID_BATTERY_SENSE_1  0xA3A4
-#define PRODUCT_ID_BATTERY_SENSE_2  0xA3A5
-#define IS_BATTERY_SENSE(pid) ((pid) == PRODUCT_ID_BATTERY_SENSE_1 || (pid) == PRODUCT_ID_BATTERY_SENSE_2)
-
-// Manufacturer data header (common to all Victron devices)
-typedef struct {
-  uint16_t vendorID;         // 0x02E1 = Victron
-  uint8_t beaconType;        // 0x10 = Product Advertisement
-  uint16_t productID;        // Product identifier (e.g., 0xA3A4 = Battery Sense)
-  uint8_t dataCounter;       // Record counter
-  uint8_t victronRecordType; // 0x01=Solar, 0x02=Battery Monitor, etc.
-  uint16_t nonceDataCounter; // Nonce for decryption
-  uint8_t encryptKeyMatch;   // Should match first byte of encryption key
-  uint8_t victronEncryptedData[21];
-  uint8_t nullPad;
-} __attribute__((packed)) victronManufacturerData;
+// History: per-device samples every HISTORY_FINE_MS, rolled up into buckets
+// of HISTORY_COARSE_RATIO samples. The depths are upper limits: all rings
+// share HISTORY_RAM_BUDGET bytes (set per board in platformio.ini).
+#ifndef HISTORY_RAM_BUDGET
+  #define HISTORY_RAM_BUDGET  16384
+#endif
+#define HISTORY_FINE_MS       1000
+#define HISTORY_FINE_DEPTH    600   // 10 min
+#define HISTORY_COARSE_RATIO  60    // 1 min buckets
+#define HISTORY_COARSE_DEPTH  1440  // 24 h
+#define HISTORY_NO_DATA       INT16_MIN
+
+// Flash log of history buckets and daily totals (LittleFS partition)
+#define STORAGE_FILE          "/history.log"
+#define STORAGE_FILE_OLD      "/history.old"
+#define STORAGE_FILE_MAX      (256 * 1024)  // Then rotated to STORAGE_FILE_OLD
+#define STORAGE_DAILY_FILE    "/daily.log"  // DAILY records only, kept for years
+#define STORAGE_DAILY_OLD     "/daily.old"
+#define STORAGE_DAILY_MAX     (16 * 1024)   // 1024 days of one charger per file
+#define STORAGE_TODAY_FILE    "/today.bin"  // Running totals of the current day
+#define STORAGE_DAYS_RUN      8             // 'days' lines queued per log-room check
+#define STORAGE_FLUSH_MS      (10 * 60 * 1000UL)
+#define STORAGE_QUEUE_SIZE    128           // Records, must be a power of two
+
+// Raw advertisement capture ('capture' command), for offline replay
+#ifndef CAPTURE_RING_SIZE
+  #define CAPTURE_RING_SIZE   128           // Records, power of two; allocated on first use
+#endif
+#define CAPTURE_FILE          "/capture.bin"
+#define CAPTURE_FILE_MAX      (512 * 1024)  // Flash capture stops here
+#define CAPTURE_BATCH         32            // Records per flash write...
+#define CAPTURE_FLUSH_MS      2000          // ...or whatever is queued this often
+
+// Optional Wi-Fi uplink: decoded state published to MQTT. Needs WIFI_SSID,
+// WIFI_PASSWORD and MQTT_HOST as build flags (see platformio.ini).
+#ifndef MQTT_BRIDGE
+  #define MQTT_BRIDGE         0
+#endif
+#if MQTT_BRIDGE
+  #if !defined WIFI_SSID || !defined WIFI_PASSWORD || !defined MQTT_HOST
+    #error "MQTT_BRIDGE needs -D WIFI_SSID=... -D WIFI_PASSWORD=... -D MQTT_HOST=..."
+  #endif
+  #ifndef MQTT_PORT
+    #define MQTT_PORT         1883
+  #endif
+  #ifndef MQTT_USER
+    #define MQTT_USER         ""
+  #endif
+  #ifndef MQTT_PASSWORD
+    #define MQTT_PASSWORD     ""
+  #endif
+  #ifndef MQTT_TOPIC
+    #define MQTT_TOPIC        "victron"
+  #endif
+  #ifndef MQTT_CLIENT_ID
+    #define MQTT_CLIENT_ID    "victron-scanner"
+  #endif
+#endif
+#define MQTT_BATCH_MS         5000          // Changes are collected and sent this often
+#define MQTT_FULL_MS          (5 * 60 * 1000UL)  // Complete state, for new subscribers
+#define MQTT_QUEUE_SIZE       8             // Messages, oldest dropped when full
+#define MQTT_MESSAGE_MAX      320
+#define MQTT_RETRY_MS         5000
+#define MQTT_CORE             0             // With the Wi-Fi and BT stacks, away from the worker
+#define MQTT_PRIORITY         1
+#define MQTT_STACK_SIZE       4096
+
+// Optional ESP-NOW mesh for hulls one receiver cannot cover. Scanner nodes
+// forward the Victron advertisements they hear, still encrypted, to a
+// display node, which decrypts them with its own keys. Build flags:
+// -D MESH_ROLE=1 (scanner) or 2 (display), digits only: the includes above
+// test it before these names exist.
+#define MESH_OFF              0
+#define MESH_SCANNER          1
+#define MESH_DISPLAY          2
+#ifndef MESH_ROLE
+  #define MESH_ROLE           MESH_OFF
+#endif
+#ifndef MESH_NODE_ID
+  #define MESH_NODE_ID        1             // Scanner: 1..255, reported by 'link' on the display node
+#endif
+#ifndef MESH_PEER
+  #define MESH_PEER           "ffffffffffff"  // Display node's Wi-Fi MAC (logged at boot); default broadcast
+#endif
+#ifndef MESH_CHANNEL
+  #define MESH_CHANNEL        1             // Same on every node; with MQTT_BRIDGE, the AP's channel
+#endif
+#define MESH_MAGIC            0x56          // 'V'
+#define MESH_VERSION          1
+#define MESH_FRAME_MAX        250           // ESP_NOW_MAX_DATA_LEN
+#define MESH_BATCH_MS         250           // A record waits at most this long for company
+#define MESH_SEEN_SIZE        256           // Scanner: MACs whose last forwarded nonce is kept...
+#define MESH_SEEN_WAYS        4             // ...in sets of this many, by MAC hash
+#define MESH_SEEN_LIVE_MS     10000         // Evicting an entry this recent is counted
+
+// Render scheduler: packets arriving within one frame interval are coalesced
+// into a single redraw; threshold crossings and button presses skip the wait.
+#ifndef DISPLAY_MAX_FPS
+  #define DISPLAY_MAX_FPS     4
+#endif
+#define DISPLAY_FRAME_MS      (1000 / DISPLAY_MAX_FPS)
+TaskHandle_t workerTaskHandle = nullptr;
 
 // ============================================================================
 // Device Types for Configuration
@@ -113,19 +237,96 @@ typedef struct {
 enum VictronDeviceType {
   DEVICE_SOLAR_CHARGER,
   DEVICE_SMART_SHUNT,
-  DEVICE_BATTERY_SENSE
+  DEVICE_BATTERY_SENSE,
+  DEVICE_INVERTER,
+  DEVICE_DCDC_CONVERTER,
+  DEVICE_SMART_LITHIUM
+};
+
+// Indexed by VictronDeviceType; also the names accepted by the 'add' command
+const char* const deviceTypeNames[] = { "Solar", "Shunt", "BattSense", "Inverter", "DC-DC", "Lithium" };
+
+// Indexed by VictronDeviceType: the only record type decoded for the device
+const uint8_t deviceRecordTypes[] = {
+  VICTRON_TYPE_SOLAR_CHARGER, VICTRON_TYPE_BATTERY_MONITOR, VICTRON_TYPE_BATTERY_MONITOR,
+  VICTRON_TYPE_INVERTER, VICTRON_TYPE_DCDC_CONVERTER, VICTRON_TYPE_SMART_LITHIUM
+};
+
+// Hex string -> bytes. Non-hex characters (':' separators) are skipped.
+template <size_t N>
+struct hexBytes {
+  byte b[N];
+  constexpr operator const byte*() const { return b; }
 };
 
+constexpr byte hexNibble(char c) {
+  return (c >= '0' && c <= '9') ? c - '0'
+       : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+       : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+       : 0xFF;
+}
+
+template <size_t N>
+constexpr hexBytes<N> parseHex(const char* hex) {
+  hexBytes<N> out = {};
+  size_t idx = 0;
+  bool high = true;
+  for (; *hex != '\0' && idx < N; hex++) {
+    byte nibble = hexNibble(*hex);
+    if (nibble == 0xFF) continue;
+    if (high) {
+      out.b[idx] = nibble << 4;
+    } else {
+      out.b[idx++] |= nibble;
+    }
+    high = !high;
+  }
+  return out;
+}
+
+// Device table checks, run by the compiler on every VICTRON_DEVICE() entry.
+// A bad entry stops the build at the call of this deliberately non-constexpr
+// function; the note next to the call says what is wrong.
+inline void badHexInDeviceTable() {}
+
+template <size_t N>
+constexpr hexBytes<N> checkedHex(const char* hex) {
+  size_t digits = 0;
+  for (const char* c = hex; *c != '\0'; c++) {
+    if (hexNibble(*c) != 0xFF) {
+      digits++;
+    } else if (*c != ':') {
+      badHexInDeviceTable();   // Not a hex digit
+    }
+  }
+  if (digits != 2 * N) badHexInDeviceTable();  // Wrong number of digits
+  return parseHex<N>(hex);
+}
+
+template <size_t L>
+constexpr hexBytes<6> configMac(const char (&hex)[L]) {
+  static_assert(L == 13 || L == 18, "MAC must be 12 hex digits, optionally ':'-separated");
+  return checkedHex<6>(hex);
+}
+
+template <size_t L>
+constexpr hexBytes<16> configKey(const char (&hex)[L]) {
+  static_assert(L == 33, "encryption key must be 32 hex digits");
+  return checkedHex<16>(hex);
+}
+
+// Configuration only: constexpr, so the whole table stays in flash (rodata).
+// Runtime state of the same slot lives in deviceStore.
 struct victronDevice {
-  char charMacAddr[13];
-  char charKey[33];
-  char comment[16];
+  hexBytes<6> byteMacAddr;
+  hexBytes<16> byteKey;
+  const char* comment;
   VictronDeviceType deviceType;
-  byte byteMacAddr[6];
-  byte byteKey[16];
-  char cachedDeviceName[32];
 };
 
+#define VICTRON_DEVICE(mac, key, comment, type) \
+  { configMac(mac), configKey(key), comment, type }
+
 // ============================================================================
 // CONFIGURAZIONE DEI TUOI DISPOSITIVI VICTRON - MODIFICA QUI
 // ============================================================================
@@ -133,60 +334,126 @@ struct victronDevice {
 // Menu dispositivo → Impostazioni → Info prodotto → Bluetooth Instant Readout
 // ============================================================================
 
-struct victronDevice victronDevices[] = {
+constexpr victronDevice victronDevices[] = {
   // SmartSolar MPPT - GIA' CONFIGURATO
-  { "c15639b47db5", "f2dcc3ba40edb8de7e07d7638f13f971", "SmartSolar", DEVICE_SOLAR_CHARGER, {0}, {0}, "(unknown)" },
+  VICTRON_DEVICE("c15639b47db5", "f2dcc3ba40edb8de7e07d7638f13f971", "SmartSolar", DEVICE_SOLAR_CHARGER),
   
   // Smart Shunt - CONFIGURATO
-  { "f93ccf0c1b2e", "4c1e3ccd3d892db13d7a43740b7f1021", "SmartShunt", DEVICE_SMART_SHUNT, {0}, {0}, "(unknown)" },
+  VICTRON_DEVICE("f93ccf0c1b2e", "4c1e3ccd3d892db13d7a43740b7f1021", "SmartShunt", DEVICE_SMART_SHUNT),
   
   // Battery Smart Sense - CONFIGURATO
-  { "c1b691bd9e2b", "b7abe19c003240be9dae89b8c372dd43", "BattSense", DEVICE_BATTERY_SENSE, {0}, {0}, "(unknown)" },
+  VICTRON_DEVICE("c1b691bd9e2b", "b7abe19c003240be9dae89b8c372dd43", "BattSense", DEVICE_BATTERY_SENSE),
 };
 
 // ============================================================================
 
-int victronDeviceCount = sizeof(victronDevices) / sizeof(victronDevices[0]);
+constexpr int victronDeviceCount = sizeof(victronDevices) / sizeof(victronDevices[0]);
 
-// Global data storage for display
-struct {
-  bool valid;
-  float batteryVoltage;
-  float batteryCurrent;
-  float todayYield;
-  uint16_t inputPower;
-  float loadCurrent;
-  uint8_t chargeState;
-  uint8_t errorCode;
-  int rssi;
-  char deviceName[32];
-} solarData = {false};
+constexpr bool configMacsUnique() {
+  for (int i = 0; i < victronDeviceCount; i++) {
+    for (int j = i + 1; j < victronDeviceCount; j++) {
+      bool same = true;
+      for (int k = 0; k < 6; k++) same = same && victronDevices[i].byteMacAddr.b[k] == victronDevices[j].byteMacAddr.b[k];
+      if (same) return false;
+    }
+  }
+  return true;
+}
 
-struct {
-  bool valid;
-  float batteryVoltage;
-  float batteryCurrent;
-  float soc;              // State of Charge %
-  float consumedAh;
-  uint16_t ttg;           // Time to go (minutes)
-  int rssi;
-  char deviceName[32];
-} shuntData = {false};
+static_assert(configMacsUnique(), "the same MAC appears twice in victronDevices[]");
+
+// ============================================================================
+// Device State Store
+// ============================================================================
+// State of every configured device, indexed by its device table slot.
+// Struct-of-arrays: pages and outputs that need one column (every RSSI, every
+// timestamp) walk one contiguous array. Written by the worker task only.
+#define MAX_DEVICES   8
 
 struct {
-  bool valid;
-  float batteryVoltage;
-  float temperature;      // °C
-  int rssi;
-  char deviceName[32];
-} batterySenseData = {false};
+  int32_t value[MAX_DEVICES][RECORD_FIELDS_MAX];  // Last decoded fields, layout order
+  uint32_t validMask[MAX_DEVICES];    // Fields of value[] that are not N/A
+  uint8_t recordType[MAX_DEVICES];    // Layout of value[], 0 = nothing decoded yet
+  uint32_t lastSeenMs[MAX_DEVICES];   // Latest advertisement, repeats included
+  uint32_t lastUpdateMs[MAX_DEVICES]; // Latest decoded frame
+  int8_t rssi[MAX_DEVICES];
+  uint16_t nonce[MAX_DEVICES];        // nonceDataCounter of the last decoded frame
+  mbedtls_aes_context aesCtx[MAX_DEVICES];  // Key schedule, expanded when the slot is filled
+  bool retired[MAX_DEVICES];          // Deleted, or a free slot between enrolled ones
+  uint8_t generation[MAX_DEVICES];    // Bumped when enrollment fills the slot, stamped on flash records
+  uint16_t updatePeriodMs[MAX_DEVICES]; // Learned time between readings
+  uint8_t periodSamples[MAX_DEVICES]; // Gaps averaged into updatePeriodMs (saturates)
+  int16_t rssiAvg[MAX_DEVICES];       // EWMA of rssi, 1/16 dBm, 0 = no sample yet
+  uint16_t jitterMs[MAX_DEVICES];     // EWMA of |gap - updatePeriodMs|
+  uint16_t noncesReceived[MAX_DEVICES]; // Recent readings decoded...
+  uint16_t noncesMissed[MAX_DEVICES]; // ...and skipped over, see trackNonceGap()
+  uint8_t source[MAX_DEVICES];        // Mesh node with the best copy of the reading, 0 = this one
+} deviceStore;
+
+// Devices whose values are shown greyed out (bit = slot). Worker only.
+uint32_t staleDevices = 0;
+
+// Slots deleted over serial that the worker has not released yet (bit = slot)
+std::atomic<uint32_t> retireRequests{0};
+
+static_assert(victronDeviceCount <= MAX_DEVICES, "raise MAX_DEVICES");
+
+// Device table: victronDevices[] first, then devices enrolled at runtime
+// (see Device Provisioning). Slots are only appended while running, and the
+// new size is published after the slot is complete, so readers on other
+// tasks never see a half-filled entry.
+const victronDevice* deviceTable[MAX_DEVICES];
+std::atomic<int> deviceTableSize(0);
+
+inline const victronDevice& device(int deviceIndex) {
+  return *deviceTable[deviceIndex];
+}
+
+inline int deviceCount() {
+  return deviceTableSize.load(std::memory_order_acquire);
+}
+
+void initDeviceTable() {
+  for (int i = 0; i < victronDeviceCount; i++) deviceTable[i] = &victronDevices[i];
+  deviceTableSize.store(victronDeviceCount, std::memory_order_release);
+}
+
+inline bool deviceHasData(int deviceIndex) {
+  return deviceStore.recordType[deviceIndex] != 0;
+}
+
+inline bool fieldValid(int deviceIndex, int field) {
+  return deviceStore.validMask[deviceIndex] & (1 << field);
+}
+
+// Slot of the n-th configured device of `type`, or -1
+int findDeviceOfType(VictronDeviceType type, int n) {
+  for (int i = 0; i < deviceCount(); i++) {
+    if (device(i).deviceType == type && !deviceStore.retired[i] && n-- == 0) return i;
+  }
+  return -1;
+}
+
+int countDevicesOfType(VictronDeviceType type) {
+  int count = 0;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (device(i).deviceType == type && !deviceStore.retired[i]) count++;
+  }
+  return count;
+}
 
 // Display state
 time_t lastLEDBlinkTime = 0;
 time_t lastTick = 0;
 int displayRotation = 3;
 bool packetReceived = false;
-int displayPage = 0;  // 0=Solar, 1=Shunt/Overview
+volatile bool displayRefreshRequested = false;  // Set by loop(), consumed by the worker
+bool renderPending = false;   // Worker only: visible data changed since last frame
+bool renderUrgent = false;    // Worker only: draw now, ignore the FPS limit
+volatile bool scanRunning = false;
+volatile bool displayBlanked = false;  // Backlight off (power manager): the worker skips frames
+int displayPage = 0;  // Flat index into pageRegistry, see resolvePage()
+#define PAGE_DIAGNOSTICS  -1  // displayPage of the hidden PERF page
 
 char chargeStateNames[][6] = {
   "  off", "   1?", "   2?", " bulk", "  abs", "float", "   6?", "equal"
@@ -200,476 +467,3683 @@ char chargeStateNames[][6] = {
 #endif
 
 // Function prototypes
-void hexCharStrToByteArray(char * hexCharStr, byte * byteArray);
-byte hexCharToByte(char hexChar);
-int findDeviceByMac(byte* mac);
-bool decryptVictronData(victronManufacturerData* vicData, int deviceIndex, byte* outputData, int dataSize);
-void processSolarCharger(byte* data, int deviceIndex, int rssi, const char* deviceName);
-void processSmartShunt(byte* data, int deviceIndex, int rssi, const char* deviceName);
-void processBatterySense(byte* data, int deviceIndex, int rssi, const char* deviceName);
+int findDeviceByMac(const byte* mac);
+bool initDeviceCipher(int deviceIndex);
+void processSolarCharger(int deviceIndex, const int32_t* previous, uint32_t previousValid);
+void processSmartShunt(int deviceIndex, const int32_t* previous, uint32_t previousValid);
+void processBatterySense(int deviceIndex);
 void updateDisplay();
-float kelvinToCelsius(int16_t kelvin);
+int32_t kelvinToCentiCelsius(uint16_t centiKelvin);
+uint16_t socColor(uint16_t soc);
 
 // ============================================================================
-// Helper Functions
+// Logger
 // ============================================================================
-byte hexCharToByte(char hexChar) {
-  if (hexChar >= '0' && hexChar <= '9') return hexChar - '0';
-  if (hexChar >= 'a' && hexChar <= 'f') return hexChar - 'a' + 10;
-  if (hexChar >= 'A' && hexChar <= 'F') return hexChar - 'A' + 10;
-  return 255;
+// Callers format into a fixed-slot ring and return immediately; a low-priority
+// task drains it to the UART. A full ring drops the line and counts it, so a
+// slow serial link can never stall packet processing.
+#define LOG_SLOT_COUNT        32    // Power of two
+#define LOG_LINE_MAX          160
+#define LOG_DRAIN_PRIORITY    1
+#define LOG_DRAIN_STACK_SIZE  2048
+#define LOG_DRAIN_PERIOD_MS   10
+
+enum LogLevel {
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+};
+
+const char* logLevelNames[] = { "error", "warn", "info", "debug" };
+volatile uint8_t logLevel = LOG_LEVEL_INFO;
+
+typedef struct {
+  std::atomic<bool> ready;          // Filled by a producer, not yet written out
+  uint16_t length;
+  char text[LOG_LINE_MAX];
+} logSlot;
+
+// Multi-producer (any task), single consumer (drain task)
+struct {
+  logSlot slots[LOG_SLOT_COUNT];
+  std::atomic<uint32_t> head;       // Next slot to reserve
+  std::atomic<uint32_t> tail;       // Next slot to write out
+  std::atomic<uint32_t> dropped;
+} logRing;
+
+// Reserve a slot or count a drop. Lock-free: producers race on head only.
+logSlot* logReserve() {
+  uint32_t head = logRing.head.load(std::memory_order_relaxed);
+  do {
+    if (head - logRing.tail.load(std::memory_order_acquire) >= LOG_SLOT_COUNT) {
+      logRing.dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+  } while (!logRing.head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel,
+                                               std::memory_order_relaxed));
+  return &logRing.slots[head & (LOG_SLOT_COUNT - 1)];
 }
 
-void hexCharStrToByteArray(char * hexCharStr, byte * byteArray) {
-  int len = strlen(hexCharStr);
-  int idx = 0;
-  bool odd = true;
-  byte hi;
+void logPrintf(uint8_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void logPrintf(uint8_t level, const char* fmt, ...) {
+  if (level > logLevel) return;
+  logSlot* slot = logReserve();
+  if (slot == nullptr) return;
   
-  for (int i = 0; i < len; i++) {
-    byte nibble = hexCharToByte(hexCharStr[i]);
-    if (nibble != 255) {
-      if (odd) {
-        hi = nibble;
-      } else {
-        byteArray[idx++] = (hi << 4) | nibble;
-      }
-      odd = !odd;
-    }
-  }
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(slot->text, LOG_LINE_MAX, fmt, args);
+  va_end(args);
+  
+  slot->length = (len < 0) ? 0 : (len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len);
+  slot->ready.store(true, std::memory_order_release);
 }
 
-float kelvinToCelsius(int16_t kelvinRaw) {
-  // Temperature in 0.01K, convert to Celsius
-  float kelvin = float(kelvinRaw) * 0.01;
-  return kelvin - 273.15;
+// Bulk output (dumps, listings) only goes out while half the ring is free,
+// so it is paced by the UART instead of dropping lines
+bool logHasRoom() {
+  return logRing.head.load(std::memory_order_relaxed) - logRing.tail.load(std::memory_order_relaxed) < LOG_SLOT_COUNT / 2;
 }
 
-int findDeviceByMac(byte* mac) {
-  for (int i = 0; i < victronDeviceCount; i++) {
-    bool match = true;
-    for (int j = 0; j < 6; j++) {
-      if (mac[j] != victronDevices[i].byteMacAddr[j]) {
-        match = false;
-        break;
+void logDrainTask(void* param) {
+  uint32_t reportedDrops = 0;
+  
+  for (;;) {
+    uint32_t tail = logRing.tail.load(std::memory_order_relaxed);
+    logSlot* slot = &logRing.slots[tail & (LOG_SLOT_COUNT - 1)];
+    
+    // Slots are published in reservation order; wait for the oldest one
+    if (tail == logRing.head.load(std::memory_order_acquire) ||
+        !slot->ready.load(std::memory_order_acquire)) {
+      uint32_t drops = logRing.dropped.load(std::memory_order_relaxed);
+      if (drops != reportedDrops) {
+        Serial.printf("[LOG] %u lines dropped\n", drops - reportedDrops);
+        reportedDrops = drops;
       }
+      vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_PERIOD_MS));
+      continue;
     }
-    if (match) return i;
+    
+    Serial.write((const uint8_t*)slot->text, slot->length);
+    slot->ready.store(false, std::memory_order_relaxed);
+    logRing.tail.store(tail + 1, std::memory_order_release);
   }
-  return -1;
 }
 
-bool decryptVictronData(victronManufacturerData* vicData, int deviceIndex, byte* outputData, int dataSize) {
-  byte inputData[16];
-  
-  for (int i = 0; i < dataSize && i < 16; i++) {
-    inputData[i] = vicData->victronEncryptedData[i];
+void startLogger() {
+  xTaskCreatePinnedToCore(logDrainTask, "logDrain", LOG_DRAIN_STACK_SIZE,
+                          nullptr, LOG_DRAIN_PRIORITY, nullptr, WORKER_CORE);
+}
+
+// ============================================================================
+// Instrumentation
+// ============================================================================
+// Event counters and CPU cycle timings (esp_cpu_get_ccount) of the hot path.
+// Each histogram has a single writer task (CCOUNT is per core, and every
+// stage runs on a pinned task); readers only ever see it approximately.
+// The power manager switches the clock between 240 and 80 MHz, so each
+// sample is converted to nanoseconds at the clock it was taken with.
+// Buckets are log2 with PERF_SUB_BUCKETS steps per power of two, so p99 is
+// reported as the upper edge of its bucket (at most 25% high). 'perf reset'
+// bumps perfGeneration; each writer clears its histogram on the next sample.
+#ifndef PERF_STATS
+  #define PERF_STATS          1
+#endif
+#define PERF_SUB_BITS         2
+#define PERF_SUB_BUCKETS      (1 << PERF_SUB_BITS)
+#define PERF_BUCKETS          (32 * PERF_SUB_BUCKETS)
+
+enum PerfStage { PERF_CALLBACK, PERF_LOOKUP, PERF_DECRYPT, PERF_DECODE, PERF_DISPLAY, PERF_STAGE_COUNT };
+const char* const perfStageNames[] = { "onResult", "lookup", "decrypt", "decode", "display" };
+
+typedef struct {
+  uint32_t generation;
+  uint32_t count;
+  uint32_t min;                       // ns
+  uint32_t max;
+  uint64_t sum;
+  uint32_t buckets[PERF_BUCKETS];
+} perfHistogram;
+
+struct {
+  perfHistogram stages[PERF_STAGE_COUNT];
+  std::atomic<uint32_t> adverts;      // Every onResult call
+  std::atomic<uint32_t> victronAdverts;
+  std::atomic<uint32_t> unknownMacs;  // Victron adverts from unconfigured MACs
+  std::atomic<uint32_t> keyMismatches;
+  uint32_t dropped;                   // Copy of packetQueue.dropped (worker)
+  uint32_t queueHighWater;            // Written by the BLE task only
+} perf;
+
+std::atomic<uint32_t> perfGeneration(0);
+std::atomic<uint32_t> perfNsPerCycle(0);  // 16.16 fixed point, see perfClockChanged()
+
+// Call after every CPU clock change
+void perfClockChanged() {
+  perfNsPerCycle.store((1000u << 16) / getCpuFrequencyMhz(), std::memory_order_relaxed);
+}
+
+inline uint32_t perfNow() {
+#if PERF_STATS
+  return esp_cpu_get_ccount();
+#else
+  return 0;
+#endif
+}
+
+uint8_t perfBucket(uint32_t ns) {
+  if (ns < PERF_SUB_BUCKETS) return ns;
+  int msb = 31 - __builtin_clz(ns);
+  return (msb - PERF_SUB_BITS + 1) * PERF_SUB_BUCKETS + ((ns >> (msb - PERF_SUB_BITS)) & (PERF_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls in `bucket`
+uint32_t perfBucketTop(int bucket) {
+  if (bucket < PERF_SUB_BUCKETS) return bucket;
+  int shift = bucket / PERF_SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t)(PERF_SUB_BUCKETS | (bucket & (PERF_SUB_BUCKETS - 1))) << shift;
+  return (uint32_t)min<uint64_t>(low + (1ULL << shift) - 1, UINT32_MAX);
+}
+
+// Record the time elapsed since `start` (a perfNow() value)
+void perfRecord(PerfStage stage, uint32_t start) {
+#if PERF_STATS
+  uint32_t cycles = esp_cpu_get_ccount() - start;
+  uint32_t ns = (uint32_t)min<uint64_t>((uint64_t)cycles * perfNsPerCycle.load(std::memory_order_relaxed) >> 16, UINT32_MAX);
+  perfHistogram* h = &perf.stages[stage];
+  uint32_t generation = perfGeneration.load(std::memory_order_relaxed);
+  if (h->generation != generation) {
+    memset(h, 0, sizeof(*h));
+    h->generation = generation;
   }
+  if (h->count == 0 || ns < h->min) h->min = ns;
+  if (ns > h->max) h->max = ns;
+  h->count++;
+  h->sum += ns;
+  h->buckets[perfBucket(ns)]++;
+#endif
+}
 
-  esp_aes_context ctx;
-  esp_aes_init(&ctx);
+inline void perfCount(std::atomic<uint32_t>& counter) {
+#if PERF_STATS
+  counter.fetch_add(1, std::memory_order_relaxed);
+#endif
+}
 
-  auto status = esp_aes_setkey(&ctx, victronDevices[deviceIndex].byteKey, AES_KEY_BITS);
-  if (status != 0) {
-    esp_aes_free(&ctx);
-    return false;
+// ns at the p99 rank, 0 if empty
+uint32_t perfPercentile99(const perfHistogram* h) {
+  uint32_t rank = h->count - h->count / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < PERF_BUCKETS && h->count > 0; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) return min(perfBucketTop(i), h->max);
   }
+  return h->max;
+}
+
+// ns to whole microseconds
+uint32_t perfMicros(uint64_t ns) {
+  return (uint32_t)(ns / 1000);
+}
 
-  byte data_counter_lsb = (vicData->nonceDataCounter) & 0xff;
-  byte data_counter_msb = ((vicData->nonceDataCounter) >> 8) & 0xff;
-  uint8_t nonce_counter[16] = {data_counter_lsb, data_counter_msb, 0};
-  uint8_t stream_block[16] = {0};
-  size_t nonce_offset = 0;
+bool perfCurrent(const perfHistogram* h) {
+  return h->generation == perfGeneration.load(std::memory_order_relaxed) && h->count > 0;
+}
 
-  status = esp_aes_crypt_ctr(&ctx, dataSize, &nonce_offset, nonce_counter, stream_block, inputData, outputData);
-  esp_aes_free(&ctx);
-  
-  return (status == 0);
+// Serial: perf [reset]
+void perfCommand(const char* arg) {
+#if PERF_STATS
+  if (arg != nullptr && strcmp(arg, "reset") == 0) {
+    perfGeneration.fetch_add(1, std::memory_order_relaxed);
+    perf.adverts = 0;
+    perf.victronAdverts = 0;
+    perf.unknownMacs = 0;
+    perf.keyMismatches = 0;
+    perf.queueHighWater = 0;
+    logPrintf(LOG_LEVEL_ERROR, "[PERF] reset\n");
+    return;
+  }
+  logPrintf(LOG_LEVEL_ERROR, "[PERF] adverts:%u victron:%u unknown:%u keyMismatch:%u dropped:%u queueMax:%u (%u MHz)\n",
+    perf.adverts.load(), perf.victronAdverts.load(), perf.unknownMacs.load(), perf.keyMismatches.load(),
+    perf.dropped, perf.queueHighWater, getCpuFrequencyMhz());
+  for (int i = 0; i < PERF_STAGE_COUNT; i++) {
+    const perfHistogram* h = &perf.stages[i];
+    if (!perfCurrent(h)) {
+      logPrintf(LOG_LEVEL_ERROR, "[PERF] %-8s no samples\n", perfStageNames[i]);
+      continue;
+    }
+    logPrintf(LOG_LEVEL_ERROR, "[PERF] %-8s n:%u min:%uus avg:%uus p99:%uus max:%uus (avg %u ns)\n",
+      perfStageNames[i], h->count, perfMicros(h->min), perfMicros(h->sum / h->count),
+      perfMicros(perfPercentile99(h)), perfMicros(h->max), (uint32_t)(h->sum / h->count));
+  }
+#else
+  logPrintf(LOG_LEVEL_ERROR, "[PERF] built with PERF_STATS=0\n");
+#endif
 }
 
 // ============================================================================
-// Device Data Processors
+// Telemetry
 // ============================================================================
-void processSolarCharger(byte* data, int deviceIndex, int rssi, const char* deviceName) {
-  victronSolarData* solar = (victronSolarData*)data;
-  
-  // Validate data
-  byte unusedBits = solar->outputCurrentHi & 0xfe;
-  if (unusedBits != 0xfe) return;
-  
-  solarData.valid = true;
-  solarData.batteryVoltage = float(solar->batteryVoltage) * 0.01;
-  solarData.batteryCurrent = float(solar->batteryCurrent) * 0.1;
-  solarData.todayYield = float(solar->todayYield) * 0.01 * 1000;
-  solarData.inputPower = solar->inputPower;
-  solarData.chargeState = solar->deviceState;
-  solarData.errorCode = solar->errorCode;
-  solarData.rssi = rssi;
-  
-  int outputCurrentInt = ((solar->outputCurrentHi & 0x01) << 9) | solar->outputCurrentLo;
-  solarData.loadCurrent = float(outputCurrentInt) * 0.1;
-  
-  strncpy(solarData.deviceName, deviceName, 31);
-  
-  char stateName[6];
-  if (solar->deviceState <= 7) {
-    strcpy(stateName, chargeStateNames[solar->deviceState]);
-  } else {
-    sprintf(stateName, "%d?", solar->deviceState);
+// Decoded readings go out as human-readable lines, as binary frames, or both.
+// Binary frame (before COBS): type, device index, RSSI, fixed-point payload in
+// the protocol's native units (little endian), CRC-16/CCITT-FALSE over all of
+// it. Frames are COBS-encoded and wrapped in 0x00 delimiters; the leading
+// delimiter lets the host resync after any interleaved text line.
+#define TELEMETRY_TEXT        0x01
+#define TELEMETRY_BINARY      0x02
+
+#ifndef TELEMETRY_MODE
+  #define TELEMETRY_MODE      TELEMETRY_TEXT
+#endif
+
+#define FRAME_TYPE_SOLAR          0x01
+#define FRAME_TYPE_SHUNT          0x02
+#define FRAME_TYPE_BATTERY_SENSE  0x03
+#define FRAME_TYPE_RECORD         0x10  // Any layout: record type, valid mask, int32 per field
+#define FRAME_TYPE_CAPTURE        0x20  // Raw advertisement, see captureRecord
+#define TELEMETRY_PAYLOAD_MAX     80
+
+volatile uint8_t telemetryMode = TELEMETRY_MODE;
+
+typedef struct {
+  int16_t batteryVoltage;    // 0.01V
+  int16_t batteryCurrent;    // 0.1A
+  uint16_t todayYield;       // 0.01kWh
+  uint16_t inputPower;       // W
+  uint16_t loadCurrent;      // 0.1A
+  uint8_t chargeState;
+  uint8_t errorCode;
+} __attribute__((packed)) telemetrySolarFrame;
+
+typedef struct {
+  int16_t batteryVoltage;    // 0.01V, 0x7FFF = N/A
+  int32_t batteryCurrent;    // 0.001A, 0x1FFFFF = N/A
+  uint16_t soc;              // 0.1%, 0x3FF = N/A
+  uint16_t ttg;              // minutes, 0xFFFF = N/A
+  uint32_t consumedAh;       // 0.1Ah consumed, 0xFFFFF = N/A
+} __attribute__((packed)) telemetryShuntFrame;
+
+typedef struct {
+  int16_t batteryVoltage;    // 0.01V
+  uint16_t temperature;      // 0.01K
+} __attribute__((packed)) telemetryBatterySenseFrame;
+
+uint16_t crc16Ccitt(const uint8_t* data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
   }
-  
-  Serial.printf("[SOLAR] %s | %.2fV %.1fA | %dW | Yield:%.0fWh | Load:%.1fA | %s | RSSI:%d\n",
-    deviceName, solarData.batteryVoltage, solarData.batteryCurrent,
-    solarData.inputPower, solarData.todayYield, solarData.loadCurrent,
-    stateName, rssi);
+  return crc;
 }
 
-void processSmartShunt(byte* data, int deviceIndex, int rssi, const char* deviceName) {
-  victronBatteryMonitorData* monitor = (victronBatteryMonitorData*)data;
-  
-  shuntData.valid = true;
-  shuntData.batteryVoltage = float(monitor->batteryVoltage) * 0.01;
-  shuntData.ttg = monitor->ttg;
-  shuntData.rssi = rssi;
-  
-  // Estrai aux_input (primi 2 bit di packedData[0])
-  uint8_t auxInput = monitor->packedData[0] & 0x03;
-  
-  // Estrai current (22 bit, signed) - bit 2-23
-  int32_t currentRaw = ((monitor->packedData[0] >> 2) | 
-                        (monitor->packedData[1] << 6) | 
-                        (monitor->packedData[2] << 14)) & 0x3FFFFF;
-  // Sign extend da 22 bit
-  if (currentRaw & 0x200000) currentRaw |= 0xFFC00000;
-  shuntData.batteryCurrent = float(currentRaw) * 0.001;
-  
-  // Estrai SOC (10 bit) - ultimi 10 bit
-  uint16_t socRaw = ((monitor->packedData[5] >> 4) | (monitor->packedData[6] << 4)) & 0x3FF;
-  if (socRaw != 0x3FF) {  // 0x3FF = N/A
-    shuntData.soc = float(socRaw) * 0.1;
+// COBS-encode `len` bytes into out (needs len + len/254 + 1 bytes)
+size_t cobsEncode(const uint8_t* in, size_t len, uint8_t* out) {
+  size_t codePos = 0;
+  size_t outPos = 1;
+  uint8_t code = 1;
+  for (size_t i = 0; i < len; i++) {
+    if (in[i] == 0) {
+      out[codePos] = code;
+      codePos = outPos++;
+      code = 1;
+    } else {
+      out[outPos++] = in[i];
+      if (++code == 0xFF) {
+        out[codePos] = code;
+        codePos = outPos++;
+        code = 1;
+      }
+    }
   }
-  
-  strncpy(shuntData.deviceName, deviceName, 31);
-  
-  Serial.printf("[SHUNT] %s | %.2fV %.2fA | SOC:%.1f%% | TTG:%dmin | RSSI:%d\n",
-    deviceName, shuntData.batteryVoltage, shuntData.batteryCurrent,
-    shuntData.soc, shuntData.ttg, rssi);
+  out[codePos] = code;
+  return outPos;
 }
 
-void processBatterySense(byte* data, int deviceIndex, int rssi, const char* deviceName) {
-  // Battery Sense usa lo stesso formato del Battery Monitor
-  victronBatteryMonitorData* monitor = (victronBatteryMonitorData*)data;
-  
-  // Estrai aux_input (primi 2 bit)
-  uint8_t auxInput = monitor->packedData[0] & 0x03;
+// Queue one telemetry frame on the log ring (never blocks)
+void sendTelemetryFrame(uint8_t type, int deviceIndex, int rssi, const void* payload, size_t len) {
+  uint8_t raw[3 + TELEMETRY_PAYLOAD_MAX + 2];
+  if (len > TELEMETRY_PAYLOAD_MAX) return;
   
-  batterySenseData.valid = true;
-  batterySenseData.batteryVoltage = float(monitor->batteryVoltage) * 0.01;
-  batterySenseData.rssi = rssi;
+  raw[0] = type;
+  raw[1] = deviceIndex;
+  raw[2] = (uint8_t)(int8_t)rssi;
+  memcpy(&raw[3], payload, len);
+  uint16_t crc = crc16Ccitt(raw, 3 + len);
+  raw[3 + len] = crc & 0xff;
+  raw[4 + len] = crc >> 8;
   
-  // Temperatura: auxValue contiene Kelvin * 100 (se auxInput == 2)
-  if (auxInput == 2) {
-    float tempKelvin = float(monitor->auxValue) * 0.01;
-    batterySenseData.temperature = tempKelvin - 273.15;  // Converti in Celsius
+  logSlot* slot = logReserve();
+  if (slot == nullptr) return;
+  slot->text[0] = 0x00;
+  size_t encoded = cobsEncode(raw, 5 + len, (uint8_t*)&slot->text[1]);
+  slot->text[1 + encoded] = 0x00;
+  slot->length = encoded + 2;
+  slot->ready.store(true, std::memory_order_release);
+}
+
+// ============================================================================
+// Helper Functions
+// ============================================================================
+int32_t kelvinToCentiCelsius(uint16_t centiKelvin) {
+  // Temperature in 0.01K, convert to 0.01 C
+  return (int32_t)centiKelvin - 27315;
+}
+
+// Text for a fixed-point value with `decimals` fractional digits, rounded to
+// `shown` digits: fixedToText(1345, 2, 1).s == "13.5". Returned by value so
+// several can be used in one printf call.
+typedef struct { char s[14]; } fixedText;
+
+fixedText fixedToText(int32_t value, uint8_t decimals, uint8_t shown) {
+  static const uint32_t pow10[] = { 1, 10, 100, 1000, 10000 };
+  fixedText t;
+  uint32_t drop = pow10[decimals - shown];
+  uint32_t unit = pow10[shown];
+  bool negative = value < 0;
+  uint32_t mag = negative ? (uint32_t)(-(int64_t)value) : (uint32_t)value;
+  mag = (mag + drop / 2) / drop;
+  const char* sign = (negative && mag != 0) ? "-" : "";
+  if (shown == 0) {
+    snprintf(t.s, sizeof(t.s), "%s%u", sign, mag);
   } else {
-    // Fallback: prova comunque a interpretare come temperatura
-    float tempKelvin = float(monitor->auxValue) * 0.01;
-    batterySenseData.temperature = tempKelvin - 273.15;
+    snprintf(t.s, sizeof(t.s), "%s%u.%0*u", sign, mag / unit, shown, mag % unit);
   }
-  
-  strncpy(batterySenseData.deviceName, deviceName, 31);
-  
-  Serial.printf("[TEMP] %s | %.2fV | Temp:%.1f C | auxIn:%d | RSSI:%d\n",
-    deviceName, batterySenseData.batteryVoltage, batterySenseData.temperature, 
-    auxInput, rssi);
+  return t;
+}
+
+// "--", for a field the device reported as not available
+fixedText naText() {
+  fixedText t;
+  strcpy(t.s, "--");
+  return t;
+}
+
+// fixedToText() of a stored field, or "--" if it is N/A
+fixedText fieldText(int deviceIndex, int field, uint8_t decimals, uint8_t shown) {
+  return fieldValid(deviceIndex, field) ? fixedToText(deviceStore.value[deviceIndex][field], decimals, shown) : naText();
+}
+
+// Expand the key once; the context is reused for every packet of this device
+bool initDeviceCipher(int deviceIndex) {
+  return victronCipherInit(&deviceStore.aesCtx[deviceIndex], device(deviceIndex).byteKey);
 }
 
 // ============================================================================
-// Display Update
+// System Aggregates
 // ============================================================================
-void updateDisplay() {
-#if defined M5STICKC || defined M5STICKCPLUS
-  display.fillScreen(COLOR_BACKGROUND);
-  display.setCursor(0, 0);
+// Totals shown on the SYSTEM page. updateAggregates() applies the difference
+// between a device's previous and new reading, so nothing here rescans the
+// store on a redraw. Only min/max temperature needs a pass over the sensors,
+// and only when one of them reports a different temperature.
+struct {
+  int32_t pvPowerW;          // Sum of PV power over all solar chargers
+  int32_t batteryCurrentMa;  // Net battery current over all shunts, + = charging
+  int32_t batteryPowerW;     // Net battery power over all shunts, + = charging
+  int32_t tempMin;           // 0.01°C, valid if tempCount > 0
+  int32_t tempMax;
+  uint8_t solarCount;        // Devices contributing to each total
+  uint8_t shuntCount;
+  uint8_t tempCount;
+} systemTotals;
+
+inline int32_t validOrZero(const int32_t* values, uint32_t valid, int field) {
+  return (valid & (1 << field)) ? values[field] : 0;
+}
+
+int32_t shuntPowerW(const int32_t* values, uint32_t valid) {
+  // 0.01V x mA = 10 uW
+  return (int32_t)((int64_t)validOrZero(values, valid, MONITOR_BATTERY_VOLTAGE) *
+                   validOrZero(values, valid, MONITOR_BATTERY_CURRENT) / 100000);
+}
+
+// Battery temperature in 0.01°C; false if this reading carries none
+bool readingTemperature(int deviceIndex, const int32_t* values, uint32_t valid, int32_t* centiCelsius) {
+  if (!(valid & (1 << MONITOR_AUX_VALUE))) return false;
+  switch (device(deviceIndex).deviceType) {
+    case DEVICE_BATTERY_SENSE:
+      break;
+    case DEVICE_SMART_SHUNT:
+      if (values[MONITOR_AUX_INPUT] != AUX_INPUT_TEMPERATURE) return false;
+      break;
+    default:
+      return false;
+  }
+  *centiCelsius = kelvinToCentiCelsius(values[MONITOR_AUX_VALUE]);
+  return true;
+}
+
+void recomputeTemperatureRange() {
+  systemTotals.tempCount = 0;
+  for (int i = 0; i < deviceCount(); i++) {
+    int32_t t;
+    if (!readingTemperature(i, deviceStore.value[i], deviceStore.validMask[i], &t)) continue;
+    if (systemTotals.tempCount == 0 || t < systemTotals.tempMin) systemTotals.tempMin = t;
+    if (systemTotals.tempCount == 0 || t > systemTotals.tempMax) systemTotals.tempMax = t;
+    systemTotals.tempCount++;
+  }
+}
+
+// Called after deviceStore holds the new reading; previousValid is 0 if
+// the device had none before, and the new validMask is 0 once it is removed
+void updateAggregates(int deviceIndex, const int32_t* previous, uint32_t previousValid) {
+  const int32_t* v = deviceStore.value[deviceIndex];
+  uint32_t valid = deviceStore.validMask[deviceIndex];
+  int joined = (valid != 0) - (previousValid != 0);   // +1 first reading, -1 removed
   
-  if (displayPage == 0) {
-    // Pagina SOLAR
-    display.setTextColor(COLOR_TITLE, COLOR_BACKGROUND);
-    display.println("=SOLAR=");
-    display.setTextColor(COLOR_TEXT, COLOR_BACKGROUND);
-    
-    if (solarData.valid) {
-      display.printf("%.2fV", solarData.batteryVoltage);
-      if (solarData.batteryCurrent < 0) {
-        display.setTextColor(COLOR_NEGATIVE, COLOR_BACKGROUND);
-      }
-      display.printf(" %.1fA\n", solarData.batteryCurrent);
-      display.setTextColor(COLOR_TEXT, COLOR_BACKGROUND);
+  switch (device(deviceIndex).deviceType) {
+    case DEVICE_SOLAR_CHARGER:
+      systemTotals.pvPowerW += validOrZero(v, valid, SOLAR_PV_POWER) - validOrZero(previous, previousValid, SOLAR_PV_POWER);
+      systemTotals.solarCount += joined;
+      break;
       
-      display.printf("%dW\n", solarData.inputPower);
-      display.printf("%.0fWh\n", solarData.todayYield);
+    case DEVICE_SMART_SHUNT:
+      systemTotals.batteryCurrentMa += validOrZero(v, valid, MONITOR_BATTERY_CURRENT) -
+                                       validOrZero(previous, previousValid, MONITOR_BATTERY_CURRENT);
+      systemTotals.batteryPowerW += shuntPowerW(v, valid) - shuntPowerW(previous, previousValid);
+      systemTotals.shuntCount += joined;
+      break;
       
-      // Charge state
-      char stateName[6];
-      if (solarData.chargeState <= 7) {
-        strcpy(stateName, chargeStateNames[solarData.chargeState]);
-        display.setTextColor(chargeStateColors[solarData.chargeState], COLOR_BACKGROUND);
-      } else {
-        sprintf(stateName, "%d?", solarData.chargeState);
-      }
-      display.printf("%s", stateName);
-    } else {
-      display.println("Waiting...");
-    }
-    
-  } else if (displayPage == 1) {
-    // Pagina INFO
-    display.setTextColor(COLOR_TITLE, COLOR_BACKGROUND);
-    display.println("=INFO=");
-    display.setTextColor(COLOR_TEXT, COLOR_BACKGROUND);
-    
-    // Temperatura batteria
-    if (batterySenseData.valid) {
-      display.setTextColor(COLOR_TEMP, COLOR_BACKGROUND);
-      display.printf("Temp:%.1fC\n", batterySenseData.temperature);
-      display.setTextColor(COLOR_TEXT, COLOR_BACKGROUND);
-    } else {
-      display.println("Temp:--");
-    }
-    
-    // Dati Smart Shunt
-    if (shuntData.valid) {
-      display.printf("SOC:%.0f%%\n", shuntData.soc);
-      display.printf("%.2fA\n", shuntData.batteryCurrent);
-      if (shuntData.ttg != 0xFFFF) {
-        int hours = shuntData.ttg / 60;
-        int mins = shuntData.ttg % 60;
-        display.printf("TTG:%dh%dm\n", hours, mins);
-      }
-    } else {
-      display.println("SOC:--");
-    }
-    
+    default:
+      break;
   }
-#endif
+  
+  int32_t before = 0, after = 0;
+  bool hadTemp = readingTemperature(deviceIndex, previous, previousValid, &before);
+  bool hasTemp = readingTemperature(deviceIndex, v, valid, &after);
+  if (hadTemp != hasTemp || before != after) recomputeTemperatureRange();
+}
+
+// Worker: takes the devices deleted since the last call out of the totals.
+// Their readings are dropped, so they are not counted as stale either.
+// Returns true if any was released.
+bool releaseRetiredDevices() {
+  uint32_t pending = retireRequests.exchange(0, std::memory_order_acquire);
+  if (pending == 0) return false;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (!(pending & (1u << i))) continue;
+    int32_t previous[RECORD_FIELDS_MAX];
+    memcpy(previous, deviceStore.value[i], sizeof(previous));
+    uint32_t previousValid = deviceStore.validMask[i];
+    deviceStore.validMask[i] = 0;
+    deviceStore.recordType[i] = 0;
+    updateAggregates(i, previous, previousValid);
+  }
+  return true;
 }
 
 // ============================================================================
-// BLE Callback
+// History
 // ============================================================================
-class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks {
-  void onResult(BLEAdvertisedDevice advertisedDevice) {
-    
-    if (!advertisedDevice.haveManufacturerData()) return;
-    
-    uint8_t manCharBuf[32];
-    std::string manData = advertisedDevice.getManufacturerData();
-    int manDataSize = manData.length();
-    
-    if (manDataSize > 31) manDataSize = 31;
-    manData.copy((char*)manCharBuf, manDataSize);
-    
-    victronManufacturerData* vicData = (victronManufacturerData*)manCharBuf;
-    
-    // Check Victron vendor ID
-    if (vicData->vendorID != 0x02e1) return;
-    
-    // Get MAC and find device
-    char macStr[18];
-    strcpy(macStr, advertisedDevice.getAddress().toString().c_str());
-    byte macByte[6];
-    hexCharStrToByteArray(macStr, macByte);
-    
-    int deviceIndex = findDeviceByMac(macByte);
-    
-    // Get device name
-    char deviceName[32] = "(unknown)";
-    if (advertisedDevice.haveName()) {
-      strcpy(deviceName, advertisedDevice.getName().c_str());
-      // Strip common prefixes
-      if (strstr(deviceName, "SmartSolar ") == deviceName) {
-        memmove(deviceName, deviceName + 11, strlen(deviceName) - 10);
-      } else if (strstr(deviceName, "SmartShunt ") == deviceName) {
-        memmove(deviceName, deviceName + 11, strlen(deviceName) - 10);
+// Fixed-interval samples of a few metrics per device, in two tiers: the
+// latest reading every HISTORY_FINE_MS, and every HISTORY_COARSE_RATIO fine
+// samples their avg/min/max as one coarse bucket. The open bucket is rolled
+// up sample by sample, so closing it is O(1). All rings are carved once from
+// a static pool of HISTORY_RAM_BUDGET bytes; if the configured devices need
+// more, every ring is shortened by the same factor. Worker task only.
+typedef struct {
+  VictronDeviceType deviceType;
+  uint8_t field;            // Index into the device's record layout
+  int32_t offset;           // sample = (value - offset) / divisor, fits int16
+  int16_t divisor;
+  uint8_t decimals;         // Of the sample, for display
+  const char* unit;
+  const char* label;
+  bool chart;               // Gets a chart page
+} historyMetric;
+
+const historyMetric historyMetrics[] = {
+  { DEVICE_SOLAR_CHARGER, SOLAR_PV_POWER,          0,     1,  0, "W", "PV",   true },
+  { DEVICE_SOLAR_CHARGER, SOLAR_BATTERY_VOLTAGE,   0,     1,  2, "V", "Volt", false },
+  { DEVICE_SMART_SHUNT,   MONITOR_BATTERY_CURRENT, 0,     10, 2, "A", "Bat",  true },
+  { DEVICE_SMART_SHUNT,   MONITOR_SOC,             0,     1,  1, "%", "SOC",  true },
+  { DEVICE_BATTERY_SENSE, MONITOR_AUX_VALUE,       27315, 10, 1, "C", "Temp", false },
+};
+const int historyMetricCount = sizeof(historyMetrics) / sizeof(historyMetrics[0]);
+
+typedef struct {
+  int16_t avg;
+  int16_t min;
+  int16_t max;
+} historyBucket;
+
+typedef struct {
+  uint8_t deviceIndex;
+  uint8_t metric;           // Index into historyMetrics[]
+  int16_t latest;           // Last reading, HISTORY_NO_DATA until the first one
+  
+  int16_t* fine;            // Ring of HISTORY_FINE_MS samples
+  uint16_t fineCapacity;
+  uint16_t fineCount;
+  uint16_t fineNext;
+  
+  historyBucket* coarse;    // Ring of closed buckets
+  uint16_t coarseCapacity;
+  uint16_t coarseCount;
+  uint16_t coarseNext;
+  uint32_t coarseClosed;    // Buckets closed since boot, tells readers what is new
+  
+  int32_t bucketSum;        // Open bucket, rolled up as fine samples arrive
+  int16_t bucketMin;
+  int16_t bucketMax;
+  uint8_t bucketCount;
+} historySeries;
+
+#define HISTORY_SERIES_MAX    (MAX_DEVICES * 2)
+
+historySeries historySeriesList[HISTORY_SERIES_MAX];
+int historySeriesCount = 0;
+alignas(4) uint8_t historyPool[HISTORY_RAM_BUDGET];
+
+void initHistory() {
+  // One series per metric that applies to each configured device
+  historySeriesCount = 0;
+  for (int dev = 0; dev < deviceCount(); dev++) {
+    if (deviceStore.retired[dev]) continue;
+    for (int m = 0; m < historyMetricCount && historySeriesCount < HISTORY_SERIES_MAX; m++) {
+      if (historyMetrics[m].deviceType != device(dev).deviceType) continue;
+      historySeries* s = &historySeriesList[historySeriesCount++];
+      memset(s, 0, sizeof(*s));
+      s->deviceIndex = dev;
+      s->metric = m;
+      s->latest = HISTORY_NO_DATA;
+    }
+  }
+  if (historySeriesCount == 0) return;
+  
+  uint32_t fineDepth = HISTORY_FINE_DEPTH;
+  uint32_t coarseDepth = HISTORY_COARSE_DEPTH;
+  uint32_t needed = historySeriesCount * (fineDepth * sizeof(int16_t) + coarseDepth * sizeof(historyBucket));
+  if (needed > HISTORY_RAM_BUDGET) {
+    fineDepth = fineDepth * HISTORY_RAM_BUDGET / needed;
+    coarseDepth = coarseDepth * HISTORY_RAM_BUDGET / needed;
+  }
+  
+  // Buckets first: both element types are 2-byte aligned
+  uint8_t* p = historyPool;
+  for (int i = 0; i < historySeriesCount; i++) {
+    historySeriesList[i].coarse = (historyBucket*)p;
+    historySeriesList[i].coarseCapacity = coarseDepth;
+    p += coarseDepth * sizeof(historyBucket);
+  }
+  for (int i = 0; i < historySeriesCount; i++) {
+    historySeriesList[i].fine = (int16_t*)p;
+    historySeriesList[i].fineCapacity = fineDepth;
+    p += fineDepth * sizeof(int16_t);
+  }
+  
+  if (fineDepth < HISTORY_FINE_DEPTH) {
+    logPrintf(LOG_LEVEL_WARN, "[HISTORY] %u bytes needed, budget %u: history shortened\n",
+      needed, HISTORY_RAM_BUDGET);
+  }
+  logPrintf(LOG_LEVEL_INFO, "[HISTORY] %d series, %us fine + %umin coarse, %u bytes\n",
+    historySeriesCount, fineDepth * HISTORY_FINE_MS / 1000,
+    coarseDepth * HISTORY_COARSE_RATIO * HISTORY_FINE_MS / 60000, (unsigned)(p - historyPool));
+}
+
+int16_t toHistorySample(const historyMetric* m, int32_t value) {
+  int32_t sample = (value - m->offset) / m->divisor;
+  if (sample > INT16_MAX) return INT16_MAX;
+  if (sample <= HISTORY_NO_DATA) return HISTORY_NO_DATA + 1;
+  return sample;
+}
+
+// Called once the store holds a new reading of `deviceIndex`
+void historyRecord(int deviceIndex) {
+  for (int i = 0; i < historySeriesCount; i++) {
+    historySeries* s = &historySeriesList[i];
+    if (s->deviceIndex != deviceIndex) continue;
+    const historyMetric* m = &historyMetrics[s->metric];
+    s->latest = fieldValid(deviceIndex, m->field)
+      ? toHistorySample(m, deviceStore.value[deviceIndex][m->field])
+      : HISTORY_NO_DATA;
+  }
+}
+
+void historyPushFine(historySeries* s, int16_t sample) {
+  if (s->fineCapacity > 0) {
+    s->fine[s->fineNext] = sample;
+    s->fineNext = (s->fineNext + 1) % s->fineCapacity;
+    if (s->fineCount < s->fineCapacity) s->fineCount++;
+  }
+  if (sample == HISTORY_NO_DATA) return;
+  if (s->bucketCount == 0 || sample < s->bucketMin) s->bucketMin = sample;
+  if (s->bucketCount == 0 || sample > s->bucketMax) s->bucketMax = sample;
+  s->bucketSum += sample;
+  s->bucketCount++;
+}
+
+void historyPushBucket(historySeries* s, const historyBucket* b) {
+  if (s->coarseCapacity == 0) return;
+  s->coarse[s->coarseNext] = *b;
+  s->coarseNext = (s->coarseNext + 1) % s->coarseCapacity;
+  if (s->coarseCount < s->coarseCapacity) s->coarseCount++;
+  s->coarseClosed++;
+}
+
+void historyCloseBucket(historySeries* s) {
+  historyBucket b;
+  if (s->bucketCount > 0) {
+    b.avg = s->bucketSum / s->bucketCount;
+    b.min = s->bucketMin;
+    b.max = s->bucketMax;
+  } else {
+    b.avg = b.min = b.max = HISTORY_NO_DATA;
+  }
+  historyPushBucket(s, &b);
+  s->bucketSum = 0;
+  s->bucketCount = 0;
+}
+
+// Samples every series on the fine grid; call at least once per interval.
+// Returns true if coarse buckets were closed.
+bool historyTick(uint32_t nowMs) {
+  bool closed = false;
+  static uint32_t nextFineMs = 0;
+  static uint8_t fineInBucket = 0;
+  
+  // First call, or back from a long stall: restart the grid at `now`
+  // instead of replaying the gap with stale values
+  if (nextFineMs == 0 || (int32_t)(nowMs - nextFineMs) > 10 * HISTORY_FINE_MS) {
+    nextFineMs = nowMs;
+  }
+  // A device gone stale or deleted has no current reading: its last one
+  // must not keep filling the chart and the flash log
+  for (int i = 0; i < historySeriesCount; i++) {
+    historySeries* s = &historySeriesList[i];
+    if (deviceStore.retired[s->deviceIndex] || (staleDevices & (1u << s->deviceIndex))) s->latest = HISTORY_NO_DATA;
+  }
+  while ((int32_t)(nowMs - nextFineMs) >= 0) {
+    nextFineMs += HISTORY_FINE_MS;
+    for (int i = 0; i < historySeriesCount; i++) {
+      historyPushFine(&historySeriesList[i], historySeriesList[i].latest);
+    }
+    if (++fineInBucket == HISTORY_COARSE_RATIO) {
+      fineInBucket = 0;
+      for (int i = 0; i < historySeriesCount; i++) historyCloseBucket(&historySeriesList[i]);
+      closed = true;
+    }
+  }
+  return closed;
+}
+
+const historySeries* findHistorySeries(int deviceIndex, uint8_t field) {
+  for (int i = 0; i < historySeriesCount; i++) {
+    const historySeries* s = &historySeriesList[i];
+    if (s->deviceIndex == deviceIndex && historyMetrics[s->metric].field == field) return s;
+  }
+  return nullptr;
+}
+
+// age 0 = newest; HISTORY_NO_DATA past the recorded depth
+int16_t historyFineSample(const historySeries* s, int age) {
+  if (age >= s->fineCount) return HISTORY_NO_DATA;
+  return s->fine[(s->fineNext + s->fineCapacity - 1 - age) % s->fineCapacity];
+}
+
+const historyBucket* historyCoarseBucket(const historySeries* s, int age) {
+  if (age >= s->coarseCount) return nullptr;
+  return &s->coarse[(s->coarseNext + s->coarseCapacity - 1 - age) % s->coarseCapacity];
+}
+
+// ============================================================================
+// Flash Log
+// ============================================================================
+// Append-only log on LittleFS of fixed 16-byte records: every closed history
+// bucket, and one DAILY record per charger when its yield counter restarts.
+// The worker only queues records in RAM; loop() appends them in one batch
+// every STORAGE_FLUSH_MS, so the flash sees a few hundred bytes every few
+// minutes instead of a write per packet, and its latency never stalls packet
+// processing. LittleFS spreads the appends over the partition; past
+// STORAGE_FILE_MAX the log becomes STORAGE_FILE_OLD and a new one starts.
+//
+// A day of buckets is ~100 KB, so DAILY records go to their own small log
+// that rotates only every few years. The running totals of the current day
+// (PROGRESS records, one per charger) overwrite STORAGE_TODAY_FILE at each
+// flush, and are reloaded at boot so a reboot does not split the day.
+//
+// There is no wall clock: records are stamped in minutes of logged time,
+// carried over reboots by resuming after the last record in the file.
+#define STORAGE_RECORD_BUCKET   1
+#define STORAGE_RECORD_DAILY    2
+#define STORAGE_RECORD_PROGRESS 3
+
+typedef struct __attribute__((packed)) {
+  uint8_t type;             // STORAGE_RECORD_*
+  uint8_t deviceIndex;
+  uint8_t field;            // BUCKET: field of the history series
+  uint8_t generation;       // Of the slot: records of a device since deleted do not match
+  uint32_t stamp;           // Minutes of logged time
+  int16_t a;                // BUCKET: avg   DAILY, PROGRESS: yield (0.01kWh)
+  int16_t b;                // BUCKET: min   DAILY, PROGRESS: max PV power (W)
+  int16_t c;                // BUCKET: max   DAILY, PROGRESS: min battery voltage (0.01V)
+  uint16_t crc;             // CRC-16 of the bytes above
+} storageRecord;
+
+static_assert(sizeof(storageRecord) == 16, "storageRecord must stay 16 bytes");
+
+// SPSC ring: worker task -> loop()
+struct {
+  storageRecord slots[STORAGE_QUEUE_SIZE];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> dropped;
+} storageQueue;
+
+std::atomic<bool> storageReady(false);
+uint32_t storageClockBase = 0;  // Logged minutes before this boot
+
+// Per-charger running values of the current day. Worker only.
+struct {
+  int32_t maxYield;
+  int32_t maxPv;
+  int32_t minVoltage;
+  bool active;
+} solarDay[MAX_DEVICES];
+
+// Contents of STORAGE_TODAY_FILE (slot = device). Loop task only.
+storageRecord storageToday[MAX_DEVICES];
+
+uint32_t storageNow() {
+  return storageClockBase + millis() / 60000;
+}
+
+// The record belongs to the device now in its slot
+bool storageRecordCurrent(const storageRecord* r) {
+  return r->deviceIndex < deviceCount() && !deviceStore.retired[r->deviceIndex] &&
+         r->generation == deviceStore.generation[r->deviceIndex];
+}
+
+bool storageRecordValid(const storageRecord* r) {
+  return (r->type == STORAGE_RECORD_BUCKET || r->type == STORAGE_RECORD_DAILY || r->type == STORAGE_RECORD_PROGRESS) &&
+         r->crc == crc16Ccitt((const uint8_t*)r, sizeof(*r) - 2);
+}
+
+// Producer side (worker task)
+void storageQueueRecord(uint8_t type, uint8_t deviceIndex, uint8_t field, int16_t a, int16_t b, int16_t c) {
+  if (!storageReady) return;
+  uint32_t head = storageQueue.head.load(std::memory_order_relaxed);
+  if (head - storageQueue.tail.load(std::memory_order_acquire) >= STORAGE_QUEUE_SIZE) {
+    storageQueue.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  storageRecord* r = &storageQueue.slots[head & (STORAGE_QUEUE_SIZE - 1)];
+  r->type = type;
+  r->deviceIndex = deviceIndex;
+  r->field = field;
+  r->generation = deviceStore.generation[deviceIndex];
+  r->stamp = storageNow();
+  r->a = a;
+  r->b = b;
+  r->c = c;
+  r->crc = crc16Ccitt((const uint8_t*)r, sizeof(*r) - 2);
+  storageQueue.head.store(head + 1, std::memory_order_release);
+}
+
+void storageQueueSolarDay(uint8_t type, int deviceIndex) {
+  storageQueueRecord(type, deviceIndex, 0, solarDay[deviceIndex].maxYield,
+                     constrain(solarDay[deviceIndex].maxPv, 0, INT16_MAX), solarDay[deviceIndex].minVoltage);
+}
+
+// After historyTick() closed a bucket: log the newest one of every series,
+// and where each charger's day stands
+void storageQueueBuckets() {
+  for (int i = 0; i < historySeriesCount; i++) {
+    const historySeries* s = &historySeriesList[i];
+    const historyBucket* b = historyCoarseBucket(s, 0);
+    if (b == nullptr || b->avg == HISTORY_NO_DATA) continue;
+    storageQueueRecord(STORAGE_RECORD_BUCKET, s->deviceIndex, historyMetrics[s->metric].field, b->avg, b->min, b->max);
+  }
+  for (int i = 0; i < deviceCount(); i++) {
+    if (solarDay[i].active && !deviceStore.retired[i]) storageQueueSolarDay(STORAGE_RECORD_PROGRESS, i);
+  }
+}
+
+// Yield today only ever grows during a day: a drop means the charger
+// started a new one, so the finished day is logged
+void storageTrackSolarDay(int deviceIndex) {
+  const int32_t* v = deviceStore.value[deviceIndex];
+  if (!fieldValid(deviceIndex, SOLAR_YIELD_TODAY)) return;
+  
+  bool closed = false;
+  if (solarDay[deviceIndex].active && v[SOLAR_YIELD_TODAY] < solarDay[deviceIndex].maxYield) {
+    storageQueueSolarDay(STORAGE_RECORD_DAILY, deviceIndex);
+    solarDay[deviceIndex].active = false;
+    closed = true;
+  }
+  if (!solarDay[deviceIndex].active) {
+    solarDay[deviceIndex].maxYield = 0;
+    solarDay[deviceIndex].maxPv = 0;
+    solarDay[deviceIndex].minVoltage = INT16_MAX;
+    solarDay[deviceIndex].active = true;
+  }
+  solarDay[deviceIndex].maxYield = max(solarDay[deviceIndex].maxYield, v[SOLAR_YIELD_TODAY]);
+  if (fieldValid(deviceIndex, SOLAR_PV_POWER)) {
+    solarDay[deviceIndex].maxPv = max(solarDay[deviceIndex].maxPv, v[SOLAR_PV_POWER]);
+  }
+  if (fieldValid(deviceIndex, SOLAR_BATTERY_VOLTAGE)) {
+    solarDay[deviceIndex].minVoltage = min(solarDay[deviceIndex].minVoltage, v[SOLAR_BATTERY_VOLTAGE]);
+  }
+  // Lands in the same flush as the DAILY record, so a reboot in between
+  // cannot bring the finished day back
+  if (closed) storageQueueSolarDay(STORAGE_RECORD_PROGRESS, deviceIndex);
+}
+
+// Past `max` bytes the log at `path` replaces `oldPath`
+void storageRotate(const char* path, const char* oldPath, size_t size, size_t max) {
+  if (size < max) return;
+  LittleFS.remove(oldPath);
+  LittleFS.rename(path, oldPath);
+  logPrintf(LOG_LEVEL_INFO, "[STORAGE] %s rotated\n", path);
+}
+
+// Consumer side (loop task): append everything queued in one write
+void storageFlush() {
+  uint32_t tail = storageQueue.tail.load(std::memory_order_relaxed);
+  uint32_t head = storageQueue.head.load(std::memory_order_acquire);
+  if (tail == head) return;
+  
+  File f = LittleFS.open(STORAGE_FILE, FILE_APPEND);
+  if (!f) {
+    logPrintf(LOG_LEVEL_ERROR, "[STORAGE] cannot open %s\n", STORAGE_FILE);
+    return;
+  }
+  uint32_t start = millis();
+  uint32_t count = head - tail;
+  File daily;
+  bool today = false;
+  for (; tail != head; tail++) {
+    const storageRecord* r = &storageQueue.slots[tail & (STORAGE_QUEUE_SIZE - 1)];
+    switch (r->type) {
+      case STORAGE_RECORD_DAILY:
+        if (!daily) daily = LittleFS.open(STORAGE_DAILY_FILE, FILE_APPEND);
+        if (daily) daily.write((const uint8_t*)r, sizeof(*r));
+        break;
+      case STORAGE_RECORD_PROGRESS:
+        storageToday[r->deviceIndex] = *r;
+        today = true;
+        break;
+      default:
+        f.write((const uint8_t*)r, sizeof(*r));
+        break;
+    }
+  }
+  size_t size = f.size();
+  f.close();
+  size_t dailySize = daily ? daily.size() : 0;
+  if (daily) daily.close();
+  if (today) {
+    File t = LittleFS.open(STORAGE_TODAY_FILE, FILE_WRITE);
+    if (t) t.write((const uint8_t*)storageToday, sizeof(storageToday));
+    if (t) t.close();
+  }
+  storageQueue.tail.store(tail, std::memory_order_release);
+  logPrintf(LOG_LEVEL_DEBUG, "[STORAGE] %u records in %ums, log %u bytes\n", count, millis() - start, (unsigned)size);
+  
+  storageRotate(STORAGE_FILE, STORAGE_FILE_OLD, size, STORAGE_FILE_MAX);
+  storageRotate(STORAGE_DAILY_FILE, STORAGE_DAILY_OLD, dailySize, STORAGE_DAILY_MAX);
+}
+
+// Called from loop(): flush on schedule, or early if the queue fills up
+void serviceStorage() {
+  static uint32_t lastFlush = 0;
+  if (!storageReady) return;
+  uint32_t queued = storageQueue.head.load(std::memory_order_acquire) - storageQueue.tail.load(std::memory_order_relaxed);
+  if (queued >= STORAGE_QUEUE_SIZE * 3 / 4 || (queued > 0 && millis() - lastFlush >= STORAGE_FLUSH_MS)) {
+    storageFlush();
+    lastFlush = millis();
+  }
+}
+
+// Reads records [first, first + count) of an open log, oldest first.
+// Torn or corrupt records are skipped.
+template <typename Visitor>
+void storageReadRecords(File& f, uint32_t first, uint32_t count, Visitor visit) {
+  storageRecord chunk[16];
+  f.seek(first * sizeof(storageRecord));
+  while (count > 0) {
+    uint32_t n = min(count, (uint32_t)(sizeof(chunk) / sizeof(chunk[0])));
+    size_t got = f.read((uint8_t*)chunk, n * sizeof(storageRecord)) / sizeof(storageRecord);
+    for (size_t i = 0; i < got; i++) {
+      if (storageRecordValid(&chunk[i])) visit(chunk[i]);
+    }
+    if (got < n) break;
+    count -= n;
+  }
+}
+
+// Logged minutes after the newest intact record of `path`, 0 if none
+uint32_t storageResumeClock(const char* path) {
+  File f = LittleFS.open(path, FILE_READ);
+  if (!f) return 0;
+  uint32_t resume = 0;
+  uint32_t records = f.size() / sizeof(storageRecord);
+  // A torn append can only hit the last few records
+  for (uint32_t i = records; i > 0 && i + 16 > records && resume == 0; i--) {
+    storageReadRecords(f, i - 1, 1, [&resume](const storageRecord& r) { resume = r.stamp + 1; });
+  }
+  f.close();
+  return resume;
+}
+
+// Running totals of the current day, from STORAGE_TODAY_FILE. Chargers
+// whose day ended while powered off log it with their first reading.
+int storageRestoreToday() {
+  File t = LittleFS.open(STORAGE_TODAY_FILE, FILE_READ);
+  if (!t) return 0;
+  int restored = 0;
+  storageReadRecords(t, 0, MAX_DEVICES, [&restored](const storageRecord& r) {
+    if (r.type != STORAGE_RECORD_PROGRESS || !storageRecordCurrent(&r)) return;
+    if (device(r.deviceIndex).deviceType != DEVICE_SOLAR_CHARGER) return;
+    storageToday[r.deviceIndex] = r;
+    solarDay[r.deviceIndex].maxYield = r.a;
+    solarDay[r.deviceIndex].maxPv = r.b;
+    solarDay[r.deviceIndex].minVoltage = r.c;
+    solarDay[r.deviceIndex].active = true;
+    restored++;
+  });
+  t.close();
+  return restored;
+}
+
+// Mounts the log, resumes its clock and refills the coarse history from the
+// tail of the file. Needs initHistory() first. Only the last day of records
+// is read, so boot time does not grow with the log.
+void initStorage() {
+  if (!LittleFS.begin(true)) {
+    logPrintf(LOG_LEVEL_ERROR, "[STORAGE] LittleFS mount failed, history not persisted\n");
+    return;
+  }
+  
+  // Just after a rotation the current log may still be empty
+  storageClockBase = storageResumeClock(STORAGE_FILE);
+  if (storageClockBase == 0) storageClockBase = storageResumeClock(STORAGE_FILE_OLD);
+  storageClockBase = max(storageClockBase, storageResumeClock(STORAGE_DAILY_FILE));
+  
+  File f = LittleFS.open(STORAGE_FILE, FILE_READ);
+  uint32_t records = f ? f.size() / sizeof(storageRecord) : 0;
+  uint32_t restored = 0;
+  if (records > 0) {
+    uint32_t window = historySeriesCount * HISTORY_COARSE_DEPTH;
+    uint32_t first = records > window ? records - window : 0;
+    storageReadRecords(f, first, records - first, [&restored](const storageRecord& r) {
+      if (r.type != STORAGE_RECORD_BUCKET || !storageRecordCurrent(&r)) return;
+      historySeries* s = (historySeries*)findHistorySeries(r.deviceIndex, r.field);
+      if (s == nullptr) return;
+      historyBucket b = { r.a, r.b, r.c };
+      historyPushBucket(s, &b);
+      restored++;
+    });
+  }
+  if (f) f.close();
+  int days = storageRestoreToday();
+  
+  storageReady = true;
+  logPrintf(LOG_LEVEL_INFO, "[STORAGE] %u records logged, %u buckets and %d open days restored, clock at %u min\n",
+    records, restored, days, storageClockBase);
+}
+
+// 'days' listing in progress: loop() prints it while the log ring
+// has room and resumes at the saved offset on the next loop pass. Loop task only.
+const char* const storageDailyFiles[] = { STORAGE_DAILY_OLD, STORAGE_DAILY_FILE };
+#define STORAGE_DAILY_FILE_COUNT  (sizeof(storageDailyFiles) / sizeof(storageDailyFiles[0]))
+
+struct {
+  bool active;
+  uint8_t file;             // Index in storageDailyFiles[]
+  uint32_t offset;          // Next record of that file
+  uint32_t printed;
+} storageDays;
+
+// Serial 'days': every DAILY record still on flash
+void printDailyRecords() {
+  if (!storageReady) {
+    logPrintf(LOG_LEVEL_ERROR, "[DAY] flash log not mounted\n");
+    return;
+  }
+  storageDays = { true, 0, 0, 0 };
+}
+
+void storageServiceDays() {
+  if (!storageDays.active) return;
+  while (storageDays.file < STORAGE_DAILY_FILE_COUNT) {
+    File f = LittleFS.open(storageDailyFiles[storageDays.file], FILE_READ);
+    uint32_t total = f ? f.size() / sizeof(storageRecord) : 0;
+    while (storageDays.offset < total && logHasRoom()) {
+      uint32_t n = min(total - storageDays.offset, (uint32_t)STORAGE_DAYS_RUN);
+      storageReadRecords(f, storageDays.offset, n, [](const storageRecord& r) {
+        if (r.type != STORAGE_RECORD_DAILY) return;
+        logPrintf(LOG_LEVEL_ERROR, "[DAY] %s | at %uh%02um | Yield:%dWh | Max:%dW | Min:%sV\n",
+          storageRecordCurrent(&r) ? device(r.deviceIndex).comment : "(deleted)",
+          r.stamp / 60, r.stamp % 60, r.a * 10, r.b, fixedToText(r.c, 2, 2).s);
+        storageDays.printed++;
+      });
+      storageDays.offset += n;
+    }
+    if (f) f.close();
+    if (storageDays.offset < total) return;  // Ring busy: next pass
+    storageDays.file++;
+    storageDays.offset = 0;
+  }
+  storageDays.active = false;
+  if (storageDays.printed == 0) logPrintf(LOG_LEVEL_ERROR, "[DAY] no daily records yet\n");
+}
+
+// ============================================================================
+// Capture
+// ============================================================================
+// Records every advertisement the scan reports (Victron or not) for offline
+// replay: onResult copies it into a fixed-size slot of a single-producer /
+// single-consumer ring, nothing else; no parsing, no formatting, no heap.
+// loop() drains the ring either as FRAME_TYPE_CAPTURE telemetry frames on
+// serial (only while the log ring has room, so text output is not crowded
+// out) or in batches appended to CAPTURE_FILE, which 'capture dump' streams
+// back the same way. Records the ring cannot take are counted as dropped.
+enum CaptureMode { CAPTURE_OFF, CAPTURE_SERIAL, CAPTURE_FLASH };
+const char* const captureModeNames[] = { "off", "serial", "flash" };
+
+// captureRecord and CAPTURE_PAYLOAD_MAX are in VictronCore.h, shared
+// with the host replay benchmark
+static_assert(sizeof(captureRecord) <= TELEMETRY_PAYLOAD_MAX, "capture record must fit a telemetry frame");
+static_assert((CAPTURE_RING_SIZE & (CAPTURE_RING_SIZE - 1)) == 0, "CAPTURE_RING_SIZE must be a power of two");
+
+struct {
+  captureRecord* slots;             // CAPTURE_RING_SIZE, allocated by the first 'capture'
+  std::atomic<uint8_t> mode;        // CaptureMode; the BLE task only records when not off
+  std::atomic<uint32_t> head;       // BLE task
+  std::atomic<uint32_t> tail;       // loop()
+  std::atomic<uint32_t> dropped;
+  uint32_t captured;                // Records written out, loop() only
+  uint32_t dumpOffset;              // Next record of CAPTURE_FILE to stream
+  bool dumping;
+} capture;
+
+// Producer side (BLE task)
+void captureAdvertisement(const uint8_t* mac, int rssi, const uint8_t* payload, size_t length) {
+  if (capture.mode.load(std::memory_order_acquire) == CAPTURE_OFF) return;
+  uint32_t head = capture.head.load(std::memory_order_relaxed);
+  if (head - capture.tail.load(std::memory_order_acquire) >= CAPTURE_RING_SIZE) {
+    capture.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  captureRecord* r = &capture.slots[head & (CAPTURE_RING_SIZE - 1)];
+  if (length > CAPTURE_PAYLOAD_MAX) length = CAPTURE_PAYLOAD_MAX;
+  r->timeMs = millis();
+  memcpy(r->mac, mac, 6);
+  r->rssi = rssi;
+  r->length = length;
+  memcpy(r->payload, payload, length);
+  capture.head.store(head + 1, std::memory_order_release);
+}
+
+// Room for one more frame without starving log lines
+bool captureSerialHasRoom() {
+  return logHasRoom();
+}
+
+void captureSendFrame(const captureRecord* r) {
+  // Only the used part of the payload goes out
+  sendTelemetryFrame(FRAME_TYPE_CAPTURE, 0xFF, r->rssi, r, offsetof(captureRecord, payload) + r->length);
+}
+
+// Append the queued records to CAPTURE_FILE (loop task, like storageFlush)
+void captureFlushToFile(uint32_t tail, uint32_t head) {
+  File f = LittleFS.open(CAPTURE_FILE, FILE_APPEND);
+  if (!f) {
+    logPrintf(LOG_LEVEL_ERROR, "[CAPTURE] cannot open %s, stopped\n", CAPTURE_FILE);
+    capture.mode = CAPTURE_OFF;
+    return;
+  }
+  uint32_t count = head - tail;
+  while (tail != head) {
+    uint32_t index = tail & (CAPTURE_RING_SIZE - 1);
+    uint32_t run = min(head - tail, CAPTURE_RING_SIZE - index);
+    f.write((const uint8_t*)&capture.slots[index], run * sizeof(captureRecord));
+    tail += run;
+  }
+  size_t size = f.size();
+  f.close();
+  capture.tail.store(tail, std::memory_order_release);
+  capture.captured += count;
+  if (size >= CAPTURE_FILE_MAX) {
+    capture.mode = CAPTURE_OFF;
+    logPrintf(LOG_LEVEL_WARN, "[CAPTURE] %s full (%u records), stopped\n", CAPTURE_FILE, (unsigned)(size / sizeof(captureRecord)));
+  }
+}
+
+// Streams the next part of CAPTURE_FILE ('capture dump')
+void captureServiceDump() {
+  File f = LittleFS.open(CAPTURE_FILE, FILE_READ);
+  if (!f) {
+    capture.dumping = false;
+    logPrintf(LOG_LEVEL_ERROR, "[CAPTURE] nothing to dump\n");
+    return;
+  }
+  uint32_t total = f.size() / sizeof(captureRecord);
+  captureRecord r;
+  f.seek(capture.dumpOffset * sizeof(captureRecord));
+  while (capture.dumpOffset < total && captureSerialHasRoom() &&
+         f.read((uint8_t*)&r, sizeof(r)) == sizeof(r)) {
+    captureSendFrame(&r);
+    capture.dumpOffset++;
+  }
+  f.close();
+  if (capture.dumpOffset >= total) {
+    capture.dumping = false;
+    logPrintf(LOG_LEVEL_ERROR, "[CAPTURE] dump done, %u records\n", total);
+  }
+}
+
+// Called from loop()
+void serviceCapture() {
+  static uint32_t lastFlushMs = 0;
+  if (capture.dumping) captureServiceDump();
+  if (capture.slots == nullptr) return;
+  
+  uint32_t tail = capture.tail.load(std::memory_order_relaxed);
+  uint32_t head = capture.head.load(std::memory_order_acquire);
+  switch (capture.mode.load(std::memory_order_relaxed)) {
+    case CAPTURE_SERIAL:
+      for (; tail != head && captureSerialHasRoom(); tail++) {
+        captureSendFrame(&capture.slots[tail & (CAPTURE_RING_SIZE - 1)]);
+        capture.captured++;
+      }
+      capture.tail.store(tail, std::memory_order_release);
+      break;
+      
+    case CAPTURE_FLASH:
+      if (head - tail >= CAPTURE_BATCH || (head != tail && millis() - lastFlushMs >= CAPTURE_FLUSH_MS)) {
+        captureFlushToFile(tail, head);
+        lastFlushMs = millis();
+      }
+      break;
+      
+    default:
+      // Stopped: whatever the BLE task queued last is discarded
+      capture.tail.store(head, std::memory_order_release);
+      break;
+  }
+}
+
+// Serial: capture [serial|flash|off|dump|erase]
+void captureCommand(const char* arg) {
+  if (arg != nullptr && (strcmp(arg, "serial") == 0 || strcmp(arg, "flash") == 0)) {
+    bool toFlash = strcmp(arg, "flash") == 0;
+    if (toFlash && !storageReady) {
+      logPrintf(LOG_LEVEL_ERROR, "[CAPTURE] flash not mounted\n");
+      return;
+    }
+    if (capture.slots == nullptr) {
+      capture.slots = (captureRecord*)malloc(CAPTURE_RING_SIZE * sizeof(captureRecord));
+      if (capture.slots == nullptr) {
+        logPrintf(LOG_LEVEL_ERROR, "[CAPTURE] no RAM for %u records\n", CAPTURE_RING_SIZE);
+        return;
+      }
+    }
+    capture.dumping = false;
+    capture.captured = 0;
+    capture.dropped = 0;
+    capture.mode.store(toFlash ? CAPTURE_FLASH : CAPTURE_SERIAL, std::memory_order_release);
+  } else if (arg != nullptr && strcmp(arg, "off") == 0) {
+    capture.mode = CAPTURE_OFF;
+  } else if (arg != nullptr && strcmp(arg, "dump") == 0) {
+    if (!storageReady) return;
+    capture.mode = CAPTURE_OFF;
+    capture.dumpOffset = 0;
+    capture.dumping = true;
+  } else if (arg != nullptr && strcmp(arg, "erase") == 0) {
+    if (!storageReady) return;
+    capture.mode = CAPTURE_OFF;
+    capture.dumping = false;
+    LittleFS.remove(CAPTURE_FILE);
+  }
+  
+  size_t fileRecords = 0;
+  if (storageReady) {
+    File f = LittleFS.open(CAPTURE_FILE, FILE_READ);
+    if (f) {
+      fileRecords = f.size() / sizeof(captureRecord);
+      f.close();
+    }
+  }
+  logPrintf(LOG_LEVEL_ERROR, "[CAPTURE] %s, captured:%u dropped:%u, %s holds %u records\n",
+    captureModeNames[capture.mode.load()], capture.captured, capture.dropped.load(), CAPTURE_FILE, (unsigned)fileRecords);
+}
+
+// ============================================================================
+// MQTT Bridge
+// ============================================================================
+// Every MQTT_BATCH_MS the worker compares each device's decoded fields with
+// what it last published and queues one JSON object per device holding only
+// the changed ones, e.g. victron/c0ffee123456 {"battV":13.45,"pv":120}.
+// Every MQTT_FULL_MS, and after each reconnect, all fields go out. The
+// network task owns Wi-Fi and the MQTT client and never touches the BLE
+// path; the bounded queue between them drops the oldest message, so an
+// unreachable broker costs no heap.
+#if MQTT_BRIDGE
+typedef struct {
+  char topic[sizeof(MQTT_TOPIC) + 13];
+  char payload[MQTT_MESSAGE_MAX];
+} mqttMessage;
+
+struct {
+  mqttMessage slots[MQTT_QUEUE_SIZE];
+  uint32_t head;                      // Guarded by lock: the producer can drop from the tail
+  uint32_t tail;
+  uint32_t dropped;
+  uint32_t sent;
+  portMUX_TYPE lock;
+} mqttQueue = { {}, 0, 0, 0, 0, portMUX_INITIALIZER_UNLOCKED };
+
+// Worker only: what the broker has seen, per device and field
+struct {
+  int32_t value[MAX_DEVICES][RECORD_FIELDS_MAX];
+  uint32_t validMask[MAX_DEVICES];
+  uint32_t updateMs[MAX_DEVICES];
+  uint8_t recordType[MAX_DEVICES];
+} mqttPublished;
+
+std::atomic<bool> mqttResync(true);   // Set by the network task after connecting
+TaskHandle_t mqttTaskHandle = nullptr;
+
+void mqttQueuePush(const mqttMessage* msg) {
+  portENTER_CRITICAL(&mqttQueue.lock);
+  if (mqttQueue.head - mqttQueue.tail >= MQTT_QUEUE_SIZE) {
+    mqttQueue.tail++;
+    mqttQueue.dropped++;
+  }
+  mqttQueue.slots[mqttQueue.head++ & (MQTT_QUEUE_SIZE - 1)] = *msg;
+  portEXIT_CRITICAL(&mqttQueue.lock);
+}
+
+bool mqttQueuePop(mqttMessage* out) {
+  bool found = false;
+  portENTER_CRITICAL(&mqttQueue.lock);
+  if (mqttQueue.tail != mqttQueue.head) {
+    *out = mqttQueue.slots[mqttQueue.tail++ & (MQTT_QUEUE_SIZE - 1)];
+    found = true;
+  }
+  portEXIT_CRITICAL(&mqttQueue.lock);
+  return found;
+}
+
+// Queue the fields of one device that changed since the last publish
+// (all of them if `full`). Fields that do not fit wait for the next batch.
+void mqttCollectDevice(int deviceIndex, bool full) {
+  const recordLayout* layout = findRecordLayout(deviceStore.recordType[deviceIndex]);
+  if (layout == nullptr) return;
+  if (mqttPublished.recordType[deviceIndex] != layout->recordType) {
+    mqttPublished.recordType[deviceIndex] = layout->recordType;
+    full = true;
+  }
+  
+  mqttMessage msg;
+  const byte* mac = device(deviceIndex).byteMacAddr;
+  snprintf(msg.topic, sizeof(msg.topic), MQTT_TOPIC "/%02x%02x%02x%02x%02x%02x",
+    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  size_t len = 0;
+  int fields = 0;
+  if (full) {
+    len = snprintf(msg.payload, sizeof(msg.payload), "{\"type\":\"%s\",\"rssi\":%d",
+      deviceTypeNames[device(deviceIndex).deviceType], deviceStore.rssi[deviceIndex]);
+  } else {
+    msg.payload[len++] = '{';
+  }
+  
+  uint32_t valid = deviceStore.validMask[deviceIndex];
+  int32_t* published = mqttPublished.value[deviceIndex];
+  for (uint8_t f = 0; f < layout->fieldCount; f++) {
+    bool isValid = valid & (1u << f);
+    bool wasValid = mqttPublished.validMask[deviceIndex] & (1u << f);
+    int32_t value = deviceStore.value[deviceIndex][f];
+    if (!full && isValid == wasValid && (!isValid || value == published[f])) continue;
+    
+    const fieldDescriptor& d = layout->fields[f];
+    int n = isValid
+      ? snprintf(msg.payload + len, sizeof(msg.payload) - len, "%s\"%s\":%s", len > 1 ? "," : "",
+                 d.name, fixedToText(value, d.decimals, d.decimals).s)
+      : snprintf(msg.payload + len, sizeof(msg.payload) - len, "%s\"%s\":null", len > 1 ? "," : "", d.name);
+    if (n < 0 || len + n + 2 > sizeof(msg.payload)) break;  // Room for the closing brace
+    len += n;
+    fields++;
+    published[f] = value;
+    mqttPublished.validMask[deviceIndex] = (mqttPublished.validMask[deviceIndex] & ~(1u << f)) | (valid & (1u << f));
+  }
+  if (fields == 0 && !full) return;
+  msg.payload[len++] = '}';
+  msg.payload[len] = 0;
+  mqttQueuePush(&msg);
+}
+
+// Worker task, once per loop
+void mqttCollect(uint32_t now) {
+  static uint32_t lastBatchMs = 0;
+  static uint32_t lastFullMs = 0;
+  if (now - lastBatchMs < MQTT_BATCH_MS) return;
+  lastBatchMs = now;
+  
+  bool full = mqttResync.exchange(false) || now - lastFullMs >= MQTT_FULL_MS;
+  if (full) lastFullMs = now;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (deviceStore.retired[i] || !deviceHasData(i)) continue;
+    if (!full && deviceStore.lastUpdateMs[i] == mqttPublished.updateMs[i]) continue;
+    mqttPublished.updateMs[i] = deviceStore.lastUpdateMs[i];
+    mqttCollectDevice(i, full);
+  }
+  if (mqttTaskHandle) xTaskNotifyGive(mqttTaskHandle);
+}
+
+// Wi-Fi and BT share one radio. Modem sleep is mandatory with both stacks
+// up; preferring BT keeps the scan getting its slots while Wi-Fi is busy.
+void mqttTask(void* param) {
+  WiFiClient net;
+  PubSubClient mqtt(net);
+  const char* statusTopic = MQTT_TOPIC "/status";
+  uint32_t lastAttemptMs = 0;
+  bool wifiUp = false;
+  mqttMessage msg;
+  
+  WiFi.mode(WIFI_STA);
+  WiFi.setSleep(true);
+  WiFi.setAutoReconnect(true);
+  esp_coex_preference_set(ESP_COEX_PREFER_BT);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  mqtt.setServer(MQTT_HOST, MQTT_PORT);
+  mqtt.setBufferSize(MQTT_MESSAGE_MAX + sizeof(msg.topic) + 8);  // Allocated once
+  
+  for (;;) {
+    bool connected = WiFi.status() == WL_CONNECTED;
+    if (connected != wifiUp) {
+      wifiUp = connected;
+      IPAddress ip = WiFi.localIP();
+      if (connected) logPrintf(LOG_LEVEL_INFO, "[MQTT] Wi-Fi up, %u.%u.%u.%u\n", ip[0], ip[1], ip[2], ip[3]);
+      else logPrintf(LOG_LEVEL_WARN, "[MQTT] Wi-Fi down\n");
+    }
+    
+    if (connected && !mqtt.connected() && millis() - lastAttemptMs >= MQTT_RETRY_MS) {
+      lastAttemptMs = millis();
+      if (mqtt.connect(MQTT_CLIENT_ID, *MQTT_USER ? MQTT_USER : nullptr, *MQTT_PASSWORD ? MQTT_PASSWORD : nullptr,
+                       statusTopic, 0, true, "offline")) {
+        mqtt.publish(statusTopic, "online", true);
+        mqttResync = true;
+        logPrintf(LOG_LEVEL_INFO, "[MQTT] connected to %s:%d\n", MQTT_HOST, MQTT_PORT);
+      } else {
+        logPrintf(LOG_LEVEL_WARN, "[MQTT] connect to %s failed (%d)\n", MQTT_HOST, mqtt.state());
+      }
+    }
+    
+    if (mqtt.connected()) {
+      while (mqttQueuePop(&msg)) {
+        if (!mqtt.publish(msg.topic, msg.payload)) break;  // Lost; the next full state covers it
+        mqttQueue.sent++;
+      }
+      mqtt.loop();
+    }
+    // Woken by each batch; the timeout keeps the connection alive
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+  }
+}
+
+void startMqttBridge() {
+  xTaskCreatePinnedToCore(mqttTask, "mqtt", MQTT_STACK_SIZE, nullptr, MQTT_PRIORITY, &mqttTaskHandle, MQTT_CORE);
+}
+
+// Serial: mqtt
+void mqttCommand() {
+  portENTER_CRITICAL(&mqttQueue.lock);
+  uint32_t queued = mqttQueue.head - mqttQueue.tail;
+  uint32_t dropped = mqttQueue.dropped;
+  portEXIT_CRITICAL(&mqttQueue.lock);
+  logPrintf(LOG_LEVEL_ERROR, "[MQTT] %s:%d Wi-Fi %s (%d dBm), sent:%u queued:%u dropped:%u\n", MQTT_HOST, MQTT_PORT,
+    WiFi.status() == WL_CONNECTED ? "up" : "down", WiFi.RSSI(), mqttQueue.sent, queued, dropped);
+}
+#endif
+
+// ============================================================================
+// Device Data Processors
+// ============================================================================
+// The worker has already stored the decoded fields in deviceStore; these only
+// flag threshold crossings for the render scheduler and produce the outputs.
+// Values stay in native units until fixedToText() at the text edge.
+void processSolarCharger(int deviceIndex, const int32_t* previous, uint32_t previousValid) {
+  const int32_t* v = deviceStore.value[deviceIndex];
+  int rssi = deviceStore.rssi[deviceIndex];
+  
+  // A charge state change is worth an immediate redraw
+  if (previousValid == 0 || previous[SOLAR_STATE] != v[SOLAR_STATE]) renderUrgent = true;
+  
+  if (telemetryMode & TELEMETRY_TEXT) {
+    char stateName[6];
+    if (v[SOLAR_STATE] <= 7) {
+      strcpy(stateName, chargeStateNames[v[SOLAR_STATE]]);
+    } else {
+      sprintf(stateName, "%d?", v[SOLAR_STATE]);
+    }
+    
+    logPrintf(LOG_LEVEL_INFO, "[SOLAR] %s | %sV %sA | %dW | Yield:%dWh | Load:%sA | %s | RSSI:%d\n",
+      device(deviceIndex).comment, fixedToText(v[SOLAR_BATTERY_VOLTAGE], 2, 2).s,
+      fixedToText(v[SOLAR_BATTERY_CURRENT], 1, 1).s, v[SOLAR_PV_POWER], v[SOLAR_YIELD_TODAY] * 10,
+      fixedToText(v[SOLAR_LOAD_CURRENT], 1, 1).s, stateName, rssi);
+  }
+  if (telemetryMode & TELEMETRY_BINARY) {
+    telemetrySolarFrame frame = {
+      (int16_t)v[SOLAR_BATTERY_VOLTAGE], (int16_t)v[SOLAR_BATTERY_CURRENT], (uint16_t)v[SOLAR_YIELD_TODAY],
+      (uint16_t)v[SOLAR_PV_POWER], (uint16_t)v[SOLAR_LOAD_CURRENT], (uint8_t)v[SOLAR_STATE],
+      (uint8_t)v[SOLAR_ERROR]
+    };
+    sendTelemetryFrame(FRAME_TYPE_SOLAR, deviceIndex, rssi, &frame, sizeof(frame));
+  }
+}
+
+void processSmartShunt(int deviceIndex, const int32_t* previous, uint32_t previousValid) {
+  const int32_t* v = deviceStore.value[deviceIndex];
+  int rssi = deviceStore.rssi[deviceIndex];
+  
+  // Crossing a SOC colour band is worth an immediate redraw
+  if (fieldValid(deviceIndex, MONITOR_SOC) && (!(previousValid & (1 << MONITOR_SOC)) || socColor(v[MONITOR_SOC]) != socColor(previous[MONITOR_SOC]))) {
+    renderUrgent = true;
+  }
+  
+  if (telemetryMode & TELEMETRY_TEXT) {
+    // Consumed Ah is stored as a positive count, shown as a negative charge
+    fixedText used = fieldValid(deviceIndex, MONITOR_CONSUMED_AH) ? fixedToText(-v[MONITOR_CONSUMED_AH], 1, 1) : naText();
+    logPrintf(LOG_LEVEL_INFO, "[SHUNT] %s | %sV %sA | SOC:%s%% | Used:%sAh | TTG:%smin | RSSI:%d\n",
+      device(deviceIndex).comment, fieldText(deviceIndex, MONITOR_BATTERY_VOLTAGE, 2, 2).s,
+      fieldText(deviceIndex, MONITOR_BATTERY_CURRENT, 3, 2).s, fieldText(deviceIndex, MONITOR_SOC, 1, 1).s,
+      used.s, fieldText(deviceIndex, MONITOR_TTG, 0, 0).s, rssi);
+  }
+  if (telemetryMode & TELEMETRY_BINARY) {
+    // N/A fields go out as the sentinels documented in telemetryShuntFrame
+    telemetryShuntFrame frame = {
+      (int16_t)(fieldValid(deviceIndex, MONITOR_BATTERY_VOLTAGE) ? v[MONITOR_BATTERY_VOLTAGE] : 0x7FFF),
+      fieldValid(deviceIndex, MONITOR_BATTERY_CURRENT) ? v[MONITOR_BATTERY_CURRENT] : 0x1FFFFF,
+      (uint16_t)(fieldValid(deviceIndex, MONITOR_SOC) ? v[MONITOR_SOC] : 0x3FF),
+      (uint16_t)(fieldValid(deviceIndex, MONITOR_TTG) ? v[MONITOR_TTG] : 0xFFFF),
+      (uint32_t)(fieldValid(deviceIndex, MONITOR_CONSUMED_AH) ? v[MONITOR_CONSUMED_AH] : 0xFFFFF)
+    };
+    sendTelemetryFrame(FRAME_TYPE_SHUNT, deviceIndex, rssi, &frame, sizeof(frame));
+  }
+}
+
+void processBatterySense(int deviceIndex) {
+  // Battery Sense usa lo stesso formato del Battery Monitor.
+  // Temperatura: auxValue contiene Kelvin * 100 (se auxInput == 2);
+  // con altri auxInput lo interpretiamo comunque come temperatura.
+  const int32_t* v = deviceStore.value[deviceIndex];
+  int rssi = deviceStore.rssi[deviceIndex];
+  
+  if (telemetryMode & TELEMETRY_TEXT) {
+    logPrintf(LOG_LEVEL_INFO, "[TEMP] %s | %sV | Temp:%s C | auxIn:%d | RSSI:%d\n",
+      device(deviceIndex).comment, fixedToText(v[MONITOR_BATTERY_VOLTAGE], 2, 2).s,
+      fixedToText(kelvinToCentiCelsius(v[MONITOR_AUX_VALUE]), 2, 1).s, v[MONITOR_AUX_INPUT], rssi);
+  }
+  if (telemetryMode & TELEMETRY_BINARY) {
+    telemetryBatterySenseFrame frame = { (int16_t)v[MONITOR_BATTERY_VOLTAGE], (uint16_t)v[MONITOR_AUX_VALUE] };
+    sendTelemetryFrame(FRAME_TYPE_BATTERY_SENSE, deviceIndex, rssi, &frame, sizeof(frame));
+  }
+}
+
+// Inverter, DC/DC converter, Smart Lithium: no page yet, every field is
+// logged straight from the layout table.
+void processGenericRecord(int deviceIndex, const recordLayout* layout) {
+  const int32_t* values = deviceStore.value[deviceIndex];
+  uint32_t valid = deviceStore.validMask[deviceIndex];
+  int rssi = deviceStore.rssi[deviceIndex];
+  
+  if (telemetryMode & TELEMETRY_TEXT) {
+    char line[LOG_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "[%s] %s |", layout->tag, device(deviceIndex).comment);
+    for (uint8_t i = 0; i < layout->fieldCount && len < (int)sizeof(line); i++) {
+      const fieldDescriptor& f = layout->fields[i];
+      if (valid & (1 << i)) {
+        len += snprintf(line + len, sizeof(line) - len, " %s:%s%s", f.name,
+                        fixedToText(values[i], f.decimals, f.decimals).s, f.unit);
+      } else {
+        len += snprintf(line + len, sizeof(line) - len, " %s:--", f.name);
+      }
+    }
+    logPrintf(LOG_LEVEL_INFO, "%s | RSSI:%d\n", line, rssi);
+  }
+  if (telemetryMode & TELEMETRY_BINARY) {
+    uint8_t frame[1 + 4 + 4 * RECORD_FIELDS_MAX];
+    frame[0] = layout->recordType;
+    memcpy(&frame[1], &valid, 4);
+    memcpy(&frame[5], values, 4 * layout->fieldCount);
+    sendTelemetryFrame(FRAME_TYPE_RECORD, deviceIndex, rssi, frame, 5 + 4 * layout->fieldCount);
+  }
+}
+
+// ============================================================================
+// Display Update
+// ============================================================================
+// Retained-mode rendering: every field is a widget with a fixed character box.
+// A widget is only redrawn when its formatted text or colour changes, and the
+// screen is only cleared when the page or rotation changes.
+#if defined M5STICKC || defined M5STICKCPLUS
+
+#if DISPLAY_SPRITE_BPP
+  TFT_eSprite frameBuffer = TFT_eSprite(&display);
+#endif
+TFT_eSPI* canvas = &display;       // Panel, or frameBuffer once it is allocated
+bool frameDirty = false;           // Something was drawn into frameBuffer
+
+// Allocate the frame buffer. Rotation only toggles between 1 and 3, so both
+// orientations share the same landscape-sized buffer.
+void initFrameBuffer() {
+#if DISPLAY_SPRITE_BPP
+  frameBuffer.setColorDepth(DISPLAY_SPRITE_BPP);
+  if (frameBuffer.createSprite(display.width(), display.height()) == nullptr) {
+    logPrintf(LOG_LEVEL_WARN, "[DISPLAY] No RAM for %dx%d sprite, drawing direct\n", display.width(), display.height());
+    return;
+  }
+  frameBuffer.setTextSize(DISPLAY_TEXT_SIZE);
+  frameBuffer.setTextFont(1);
+  canvas = &frameBuffer;
+  logPrintf(LOG_LEVEL_INFO, "[DISPLAY] %dx%d sprite, %d bpp\n", display.width(), display.height(), DISPLAY_SPRITE_BPP);
+#endif
+}
+
+// Send the composed frame to the panel (no-op when drawing direct)
+void pushFrame() {
+#if DISPLAY_SPRITE_BPP
+  if (canvas == &frameBuffer && frameDirty) {
+    frameBuffer.pushSprite(0, 0);
+  }
+#endif
+  frameDirty = false;
+}
+
+typedef struct {
+  uint8_t col;
+  uint8_t row;
+  uint8_t maxChars;
+  uint16_t color;                  // Colour of the text currently on screen
+  char text[DISPLAY_COLS + 1];     // Text currently on screen
+  bool drawn;
+} displayWidget;
+
+enum {
+  // SOLAR page
+  W_SOLAR_TITLE, W_SOLAR_VOLTAGE, W_SOLAR_CURRENT, W_SOLAR_POWER, W_SOLAR_YIELD, W_SOLAR_STATE,
+  // INFO page
+  W_INFO_TITLE, W_INFO_TEMP, W_INFO_SOC, W_INFO_CURRENT, W_INFO_TTG,
+  // SYSTEM page
+  W_SYSTEM_TITLE, W_SYSTEM_PV, W_SYSTEM_BATTERY, W_SYSTEM_LOAD, W_SYSTEM_TEMP,
+  // CHART page (the plot below the title is not a widget)
+  W_CHART_TITLE, W_CHART_EMPTY,
+  // PERF page (hidden diagnostics)
+  W_PERF_TITLE, W_PERF_CALLBACK, W_PERF_DECRYPT, W_PERF_DISPLAY, W_PERF_QUEUE,
+  WIDGET_COUNT
+};
+
+displayWidget widgets[WIDGET_COUNT] = {
+  // col row chars
+  {  0, 0, 13 },                   // =SOLAR=
+  {  0, 1,  6 },                   // 13.45V
+  {  6, 1,  7 },                   //  -10.5A
+  {  0, 2, 13 },                   // 120W / Waiting...
+  {  0, 3, 13 },                   // 850Wh
+  {  0, 4, 13 },                   // float
+  {  0, 0, 13 },                   // =INFO=
+  {  0, 1, 13 },                   // Temp:21.5C
+  {  0, 2, 13 },                   // SOC:87%
+  {  0, 3, 13 },                   // -2.35A
+  {  0, 4, 13 },                   // TTG:12h30m
+  {  0, 0, 13 },                   // =SYSTEM=
+  {  0, 1, 13 },                   // PV:1250W
+  {  0, 2, 13 },                   // Bat:-12.4A
+  {  0, 3, 13 },                   // Load:380W
+  {  0, 4, 13 },                   // T:18.5/21.0C
+  {  0, 0, 13 },                   // SOC 87.0%
+  {  0, 2, 13 },                   // No history
+  {  0, 0, 13 },                   // =PERF=
+  {  0, 1, 13 },                   // Cb:18/31us
+  {  0, 2, 13 },                   // Dec:42/55us
+  {  0, 3, 13 },                   // Drw:850/990us
+  {  0, 4, 13 },                   // Q:3 Drop:0
+};
+
+void invalidateWidgets() {
+  for (int i = 0; i < WIDGET_COUNT; i++) widgets[i].drawn = false;
+}
+
+// Format into widget `id`; touches the panel only if text or colour changed
+void drawWidget(int id, uint16_t color, const char* fmt, ...) {
+  displayWidget* w = &widgets[id];
+  char text[DISPLAY_COLS + 1];
+  
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(text, w->maxChars + 1, fmt, args);
+  va_end(args);
+  
+  if (w->drawn && w->color == color && strcmp(w->text, text) == 0) return;
+  
+  int x = w->col * DISPLAY_CHAR_W;
+  int y = w->row * DISPLAY_CHAR_H;
+  int textWidth = strlen(text) * DISPLAY_CHAR_W;
+  
+  canvas->setTextColor(color, COLOR_BACKGROUND);
+  canvas->setCursor(x, y);
+  canvas->print(text);
+  // Clear whatever the previous, longer text left behind in the box
+  if (textWidth < w->maxChars * DISPLAY_CHAR_W) {
+    canvas->fillRect(x + textWidth, y, w->maxChars * DISPLAY_CHAR_W - textWidth, DISPLAY_CHAR_H, COLOR_BACKGROUND);
+  }
+  frameDirty = true;
+  
+  strcpy(w->text, text);
+  w->color = color;
+  w->drawn = true;
+}
+
+#endif
+
+uint16_t socColor(uint16_t soc) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  if (soc >= 500) return COLOR_SOC_HIGH;   // 0.1% units
+  if (soc >= 200) return COLOR_SOC_MED;
+  return COLOR_SOC_LOW;
+#else
+  return 0;
+#endif
+}
+
+// ============================================================================
+// Page Registry
+// ============================================================================
+// Button A walks the flattened list: every instance of every entry in turn.
+// A page kind with several instances (one per solar charger) draws the
+// instance it is given; instances() never returns 0.
+typedef struct {
+  void (*draw)(int instance);
+  int (*instances)();
+  bool (*showsDevice)(int instance, int deviceIndex);  // Can new data from it change the page?
+} pageDescriptor;
+
+int singlePage() {
+  return 1;
+}
+
+int solarPageCount() {
+  int count = countDevicesOfType(DEVICE_SOLAR_CHARGER);
+  return count > 0 ? count : 1;
+}
+
+bool solarPageShows(int instance, int deviceIndex) {
+  return deviceIndex == findDeviceOfType(DEVICE_SOLAR_CHARGER, instance);
+}
+
+bool infoPageShows(int instance, int deviceIndex) {
+  VictronDeviceType type = device(deviceIndex).deviceType;
+  return type == DEVICE_SMART_SHUNT || type == DEVICE_BATTERY_SENSE;
+}
+
+bool systemPageShows(int instance, int deviceIndex) {
+  VictronDeviceType type = device(deviceIndex).deviceType;
+  return type == DEVICE_SOLAR_CHARGER || type == DEVICE_SMART_SHUNT || type == DEVICE_BATTERY_SENSE;
+}
+
+// Chart page: the coarse history of one series, one column per bucket, the
+// newest at the right edge. A closed bucket scrolls the plot left and draws
+// only the new columns; the whole plot is redrawn only when the page opens or
+// a value leaves the current scale, which costs at most one pass over the
+// width. With the frame buffer the scroll happens inside it, drawing direct
+// to the panel it happens in a sprite covering just the plot.
+#if defined M5STICKC || defined M5STICKCPLUS
+struct {
+  const historySeries* series;  // Series on screen, nullptr = redraw it all
+  uint32_t bucketsShown;        // series->coarseClosed at the last draw
+  int16_t low;                  // Y scale, sample units
+  int16_t high;
+} chartState;
+
+TFT_eSprite chartSprite = TFT_eSprite(&display);
+
+// Plot area: below the title row, full width
+#define CHART_TOP   DISPLAY_CHAR_H
+
+int chartSeriesCount() {
+  int count = 0;
+  for (int i = 0; i < historySeriesCount; i++) {
+    if (historyMetrics[historySeriesList[i].metric].chart) count++;
+  }
+  return count;
+}
+
+const historySeries* chartSeries(int instance) {
+  for (int i = 0; i < historySeriesCount; i++) {
+    if (historyMetrics[historySeriesList[i].metric].chart && instance-- == 0) return &historySeriesList[i];
+  }
+  return nullptr;
+}
+
+int chartY(int16_t sample, int height) {
+  return (height - 1) - (int32_t)(sample - chartState.low) * (height - 1) / (chartState.high - chartState.low);
+}
+
+void drawChartColumn(TFT_eSPI* surface, int x, int top, int height, const historyBucket* b) {
+  surface->drawFastVLine(x, top, height, COLOR_BACKGROUND);
+  if (b == nullptr || b->avg == HISTORY_NO_DATA) return;
+  int yMax = chartY(b->max, height);
+  surface->drawFastVLine(x, top + yMax, chartY(b->min, height) - yMax + 1, COLOR_CHART_RANGE);
+  surface->drawPixel(x, top + chartY(b->avg, height), COLOR_CHART_LINE);
+}
+
+// Scale to what is visible, with a margin so small moves do not rescale
+void fitChartScale(const historySeries* s, int width) {
+  int16_t low = INT16_MAX, high = INT16_MIN + 1;
+  for (int age = 0; age < width; age++) {
+    const historyBucket* b = historyCoarseBucket(s, age);
+    if (b == nullptr) break;
+    if (b->avg == HISTORY_NO_DATA) continue;
+    if (b->min < low) low = b->min;
+    if (b->max > high) high = b->max;
+  }
+  if (low > high) low = high = 0;
+  int32_t margin = (high - low) / 8 + 1;
+  chartState.low = constrain(low - margin, INT16_MIN + 1, INT16_MAX);
+  chartState.high = constrain(high + margin, INT16_MIN + 1, INT16_MAX);
+  if (chartState.high <= chartState.low) chartState.low = chartState.high - 1;
+}
+
+bool chartScaleHolds(const historySeries* s, int newBuckets) {
+  for (int age = 0; age < newBuckets; age++) {
+    const historyBucket* b = historyCoarseBucket(s, age);
+    if (b != nullptr && b->avg != HISTORY_NO_DATA && (b->min < chartState.low || b->max > chartState.high)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void drawChart(const historySeries* s) {
+  int width = display.width();
+  int height = display.height() - CHART_TOP;
+  
+  // Where to draw: the frame buffer itself, or a plot-sized sprite
+  TFT_eSprite* surface;
+  int top;
+  if (canvas != &display) {
+    surface = (TFT_eSprite*)canvas;
+    top = CHART_TOP;
+  } else {
+    if (!chartSprite.created()) {
+      chartSprite.setColorDepth(8);
+      if (chartSprite.createSprite(width, height) == nullptr) return;
+      chartSprite.fillScreen(COLOR_BACKGROUND);
+    }
+    surface = &chartSprite;
+    top = 0;
+  }
+  
+  uint32_t newBuckets = s->coarseClosed - chartState.bucketsShown;
+  if (chartState.series != s || newBuckets >= (uint32_t)width || !chartScaleHolds(s, newBuckets)) {
+    chartState.series = s;
+    fitChartScale(s, width);
+    for (int age = 0; age < width; age++) {
+      drawChartColumn(surface, width - 1 - age, top, height, historyCoarseBucket(s, age));
+    }
+  } else if (newBuckets > 0) {
+    surface->setScrollRect(0, top, width, height, COLOR_BACKGROUND);
+    surface->scroll(-(int)newBuckets, 0);
+    for (uint32_t age = 0; age < newBuckets; age++) {
+      drawChartColumn(surface, width - 1 - age, top, height, historyCoarseBucket(s, age));
+    }
+  } else {
+    return;
+  }
+  chartState.bucketsShown = s->coarseClosed;
+  
+  if (surface == &chartSprite) {
+    chartSprite.pushSprite(0, CHART_TOP);
+  } else {
+    frameDirty = true;
+  }
+}
+#endif
+
+int chartPageCount() {
+  int count = chartSeriesCount();
+  return count > 0 ? count : 1;
+}
+
+bool chartPageShows(int instance, int deviceIndex) {
+  const historySeries* s = chartSeries(instance);
+  return s != nullptr && s->deviceIndex == deviceIndex;
+}
+
+void drawChartPage(int instance) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  const historySeries* s = chartSeries(instance);
+  if (s == nullptr) {
+    drawWidget(W_CHART_TITLE, COLOR_TITLE, "=CHART=");
+    drawWidget(W_CHART_EMPTY, COLOR_TEXT, "No history");
+    return;
+  }
+  
+  const historyMetric* m = &historyMetrics[s->metric];
+  if (s->latest != HISTORY_NO_DATA) {
+    drawWidget(W_CHART_TITLE, COLOR_TITLE, "%s %s%s", m->label, fixedToText(s->latest, m->decimals, m->decimals).s, m->unit);
+  } else {
+    drawWidget(W_CHART_TITLE, COLOR_TITLE, "%s --", m->label);
+  }
+  drawChart(s);
+#endif
+}
+
+#if defined M5STICKC || defined M5STICKCPLUS
+// Values of a device not heard from for DEVICE_STALE_MS are drawn in grey
+uint16_t dataColor(int deviceIndex, uint16_t color) {
+  return (staleDevices & (1u << deviceIndex)) ? COLOR_STALE : color;
+}
+
+// Grey while any device of `type` is stale
+uint16_t typeColor(VictronDeviceType type, uint16_t color) {
+  for (int i = 0; i < deviceCount(); i++) {
+    if (device(i).deviceType == type && !deviceStore.retired[i] && (staleDevices & (1u << i))) return COLOR_STALE;
+  }
+  return color;
+}
+#endif
+
+void drawSolarPage(int instance) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  int dev = findDeviceOfType(DEVICE_SOLAR_CHARGER, instance);
+  if (solarPageCount() > 1) {
+    drawWidget(W_SOLAR_TITLE, COLOR_TITLE, "=SOLAR %d=", instance + 1);
+  } else {
+    drawWidget(W_SOLAR_TITLE, COLOR_TITLE, "=SOLAR=");
+  }
+  
+  if (dev >= 0 && deviceHasData(dev)) {
+    const int32_t* v = deviceStore.value[dev];
+    drawWidget(W_SOLAR_VOLTAGE, dataColor(dev, COLOR_TEXT), "%sV", fixedToText(v[SOLAR_BATTERY_VOLTAGE], 2, 2).s);
+    drawWidget(W_SOLAR_CURRENT, dataColor(dev, v[SOLAR_BATTERY_CURRENT] < 0 ? COLOR_NEGATIVE : COLOR_TEXT),
+               " %sA", fixedToText(v[SOLAR_BATTERY_CURRENT], 1, 1).s);
+    drawWidget(W_SOLAR_POWER, dataColor(dev, COLOR_TEXT), "%dW", v[SOLAR_PV_POWER]);
+    drawWidget(W_SOLAR_YIELD, dataColor(dev, COLOR_TEXT), "%dWh", v[SOLAR_YIELD_TODAY] * 10);
+    
+    // Charge state
+    if (v[SOLAR_STATE] <= 7) {
+      drawWidget(W_SOLAR_STATE, dataColor(dev, chargeStateColors[v[SOLAR_STATE]]), "%s", chargeStateNames[v[SOLAR_STATE]]);
+    } else {
+      drawWidget(W_SOLAR_STATE, dataColor(dev, COLOR_TEXT), "%d?", v[SOLAR_STATE]);
+    }
+  } else {
+    drawWidget(W_SOLAR_VOLTAGE, COLOR_TEXT, "");
+    drawWidget(W_SOLAR_CURRENT, COLOR_TEXT, "");
+    drawWidget(W_SOLAR_POWER, COLOR_TEXT, "Waiting...");
+    drawWidget(W_SOLAR_YIELD, COLOR_TEXT, "");
+    drawWidget(W_SOLAR_STATE, COLOR_TEXT, "");
+  }
+#endif
+}
+
+void drawInfoPage(int instance) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  drawWidget(W_INFO_TITLE, COLOR_TITLE, "=INFO=");
+  
+  // Temperatura batteria
+  int sense = findDeviceOfType(DEVICE_BATTERY_SENSE, 0);
+  if (sense >= 0 && deviceHasData(sense)) {
+    drawWidget(W_INFO_TEMP, dataColor(sense, COLOR_TEMP), "Temp:%sC",
+               fixedToText(kelvinToCentiCelsius(deviceStore.value[sense][MONITOR_AUX_VALUE]), 2, 1).s);
+  } else {
+    drawWidget(W_INFO_TEMP, COLOR_TEXT, "Temp:--");
+  }
+  
+  // Dati Smart Shunt
+  int shunt = findDeviceOfType(DEVICE_SMART_SHUNT, 0);
+  if (shunt >= 0 && deviceHasData(shunt)) {
+    const int32_t* v = deviceStore.value[shunt];
+    if (fieldValid(shunt, MONITOR_SOC)) {
+      drawWidget(W_INFO_SOC, dataColor(shunt, socColor(v[MONITOR_SOC])), "SOC:%s%%", fixedToText(v[MONITOR_SOC], 1, 0).s);
+    } else {
+      drawWidget(W_INFO_SOC, COLOR_TEXT, "SOC:--");
+    }
+    drawWidget(W_INFO_CURRENT, dataColor(shunt, COLOR_TEXT), "%sA", fixedToText(v[MONITOR_BATTERY_CURRENT], 3, 2).s);
+    if (fieldValid(shunt, MONITOR_TTG)) {
+      drawWidget(W_INFO_TTG, dataColor(shunt, COLOR_TEXT), "TTG:%dh%dm", v[MONITOR_TTG] / 60, v[MONITOR_TTG] % 60);
+    } else {
+      drawWidget(W_INFO_TTG, COLOR_TEXT, "");
+    }
+  } else {
+    drawWidget(W_INFO_SOC, COLOR_TEXT, "SOC:--");
+    drawWidget(W_INFO_CURRENT, COLOR_TEXT, "");
+    drawWidget(W_INFO_TTG, COLOR_TEXT, "");
+  }
+#endif
+}
+
+// Reads the running aggregates only, never the per-device store
+void drawSystemPage(int instance) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  drawWidget(W_SYSTEM_TITLE, COLOR_TITLE, "=SYSTEM=");
+  
+  if (systemTotals.solarCount > 0) {
+    drawWidget(W_SYSTEM_PV, typeColor(DEVICE_SOLAR_CHARGER, COLOR_TEXT), "PV:%dW", systemTotals.pvPowerW);
+  } else {
+    drawWidget(W_SYSTEM_PV, COLOR_TEXT, "PV:--");
+  }
+  
+  if (systemTotals.shuntCount > 0) {
+    drawWidget(W_SYSTEM_BATTERY, typeColor(DEVICE_SMART_SHUNT, systemTotals.batteryCurrentMa < 0 ? COLOR_NEGATIVE : COLOR_TEXT),
+               "Bat:%sA", fixedToText(systemTotals.batteryCurrentMa, 3, 1).s);
+    // Whatever PV brings in and the battery does not take goes to the loads
+    drawWidget(W_SYSTEM_LOAD, typeColor(DEVICE_SOLAR_CHARGER, typeColor(DEVICE_SMART_SHUNT, COLOR_TEXT)), "Load:%dW", systemTotals.pvPowerW - systemTotals.batteryPowerW);
+  } else {
+    drawWidget(W_SYSTEM_BATTERY, COLOR_TEXT, "Bat:--");
+    drawWidget(W_SYSTEM_LOAD, COLOR_TEXT, "Load:--");
+  }
+  
+  if (systemTotals.tempCount > 1) {
+    drawWidget(W_SYSTEM_TEMP, typeColor(DEVICE_BATTERY_SENSE, COLOR_TEMP), "T:%s/%sC", fixedToText(systemTotals.tempMin, 2, 1).s,
+               fixedToText(systemTotals.tempMax, 2, 1).s);
+  } else if (systemTotals.tempCount == 1) {
+    drawWidget(W_SYSTEM_TEMP, typeColor(DEVICE_BATTERY_SENSE, COLOR_TEMP), "T:%sC", fixedToText(systemTotals.tempMin, 2, 1).s);
+  } else {
+    drawWidget(W_SYSTEM_TEMP, COLOR_TEXT, "T:--");
+  }
+#endif
+}
+
+// Diagnostics: average / p99 of a few hot-path stages. Not in the button A
+// cycle (long press A); shows PERF_STATS data, so it changes with any packet.
+void drawPerfStage(int id, const char* label, PerfStage stage) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  const perfHistogram* h = &perf.stages[stage];
+  if (perfCurrent(h)) {
+    drawWidget(id, COLOR_TEXT, "%s:%u/%uus", label, perfMicros(h->sum / h->count), perfMicros(perfPercentile99(h)));
+  } else {
+    drawWidget(id, COLOR_UNKNOWN, "%s:--", label);
+  }
+#endif
+}
+
+void drawPerfPage(int instance) {
+#if defined M5STICKC || defined M5STICKCPLUS
+  drawWidget(W_PERF_TITLE, COLOR_TITLE, "=PERF=");
+  drawPerfStage(W_PERF_CALLBACK, "Cb", PERF_CALLBACK);
+  drawPerfStage(W_PERF_DECRYPT, "Dec", PERF_DECRYPT);
+  drawPerfStage(W_PERF_DISPLAY, "Drw", PERF_DISPLAY);
+  drawWidget(W_PERF_QUEUE, perf.dropped ? COLOR_NEGATIVE : COLOR_TEXT, "Q:%u Drop:%u", perf.queueHighWater, perf.dropped);
+#endif
+}
+
+bool perfPageShows(int instance, int deviceIndex) {
+  return true;
+}
+
+const pageDescriptor diagnosticsPage = { drawPerfPage, singlePage, perfPageShows };
+
+const pageDescriptor pageRegistry[] = {
+  { drawSolarPage,  solarPageCount, solarPageShows },
+  { drawInfoPage,   singlePage,     infoPageShows },
+  { drawSystemPage, singlePage,     systemPageShows },
+  { drawChartPage,  chartPageCount, chartPageShows },
+};
+const int pageRegistrySize = sizeof(pageRegistry) / sizeof(pageRegistry[0]);
+
+int displayPageCount() {
+  int count = 0;
+  for (int i = 0; i < pageRegistrySize; i++) count += pageRegistry[i].instances();
+  return count;
+}
+
+// Maps the flat displayPage number to its registry entry and instance
+const pageDescriptor* resolvePage(int page, int* instance) {
+  if (page == PAGE_DIAGNOSTICS) {
+    *instance = 0;
+    return &diagnosticsPage;
+  }
+  for (int i = 0; i < pageRegistrySize; i++) {
+    int n = pageRegistry[i].instances();
+    if (page < n) {
+      *instance = page;
+      return &pageRegistry[i];
+    }
+    page -= n;
+  }
+  *instance = 0;
+  return &pageRegistry[0];
+}
+
+// True if new data from this device can change the visible page
+bool pageShowsDevice(int deviceIndex) {
+  int instance;
+  const pageDescriptor* page = resolvePage(displayPage, &instance);
+  return page->showsDevice(instance, deviceIndex);
+}
+
+bool pageShowsHistory() {
+  int instance;
+  return resolvePage(displayPage, &instance)->draw == drawChartPage;
+}
+
+void updateDisplay() {
+#if defined M5STICKC || defined M5STICKCPLUS
+  static int appliedRotation = -1;
+  static int renderedPage = INT32_MIN;  // Nothing drawn yet (-1 is PAGE_DIAGNOSTICS)
+  if (appliedRotation != displayRotation || renderedPage != displayPage) {
+    if (appliedRotation != displayRotation) display.setRotation(displayRotation);
+    appliedRotation = displayRotation;
+    renderedPage = displayPage;
+    canvas->fillScreen(COLOR_BACKGROUND);
+    frameDirty = true;
+    invalidateWidgets();
+    chartState.series = nullptr;
+  }
+  
+  int instance;
+  const pageDescriptor* page = resolvePage(displayPage, &instance);
+  page->draw(instance);
+  
+  pushFrame();
+#endif
+}
+
+// ============================================================================
+// MAC Index
+// ============================================================================
+// Configured devices, in an open-addressed macIndexTable (VictronCore.h).
+// The table for victronDevices[] is computed by the compiler and lives in
+// flash. Enrolling or deleting a device builds a new table in the spare one
+// of two RAM buffers and swaps the pointer, so the BLE callback never takes
+// a lock.
+#define NEGATIVE_CACHE_SIZE   64    // Power of two, direct-mapped
+
+// Unknown Victron MACs already reported. Written by the BLE callback only.
+uint64_t negativeCache[NEGATIVE_CACHE_SIZE];
+
+constexpr macIndexTable buildConfigMacIndex() {
+  macIndexTable index = {};
+  for (int i = 0; i < victronDeviceCount; i++) macIndexInsert(index, victronDevices[i].byteMacAddr, i);
+  return index;
+}
+
+static_assert(MAC_INDEX_SIZE >= 2 * MAX_DEVICES, "raise MAC_INDEX_SIZE");
+
+constexpr macIndexTable configMacIndex = buildConfigMacIndex();
+macIndexTable liveMacIndex[2];
+std::atomic<const macIndexTable*> macIndex(&configMacIndex);
+
+// Rebuilds the index from the device table (loop task only). A reader that
+// loaded the old pointer just before the swap finishes on a table that is
+// only overwritten by the next-but-one rebuild, seconds of operator time away.
+void publishMacIndex() {
+  macIndexTable* next = (macIndex.load() == &liveMacIndex[0]) ? &liveMacIndex[1] : &liveMacIndex[0];
+  memset(next, 0, sizeof(*next));
+  for (int i = 0; i < deviceCount(); i++) {
+    if (!deviceStore.retired[i]) macIndexInsert(*next, device(i).byteMacAddr, i);
+  }
+  macIndex.store(next, std::memory_order_release);
+  // A just-enrolled MAC may sit in the unknown cache. Racing the callback
+  // here costs at most one repeated [NEW DEVICE] line.
+  memset(negativeCache, 0, sizeof(negativeCache));
+}
+
+int findDeviceByMac(const byte* mac) {
+  return macIndexFind(macIndex.load(std::memory_order_acquire), mac);
+}
+
+// True the first time an unknown MAC is seen (until evicted by a collision)
+bool rememberUnknownMac(const byte* mac) {
+  uint64_t key = packMac(mac);
+  uint64_t* entry = &negativeCache[macHash(key) & (NEGATIVE_CACHE_SIZE - 1)];
+  if (*entry == key) return false;
+  *entry = key;
+  return true;
+}
+
+// ============================================================================
+// Device Provisioning
+// ============================================================================
+// Devices enrolled over serial ('add' / 'del' / 'devices') are stored in NVS
+// as one binary blob and read back with a single getBytes() at boot, so the
+// load cost does not grow with per-device keys. Loop task only.
+//
+// Flash records, telemetry frames and the history are keyed by slot, so an
+// enrolled device keeps its slot across restarts; a deleted one leaves a
+// hole that the next 'add' fills. Filling a slot bumps its generation,
+// which the flash log stamps on every record, so the history of the
+// previous owner is never restored into the new one.
+#define PROVISION_NAMESPACE   "victron"
+#define PROVISION_BLOB        "devices"
+#define PROVISION_VERSION     1
+
+typedef struct __attribute__((packed)) {
+  uint8_t slot;             // Device table slot
+  uint8_t mac[6];
+  uint8_t key[16];
+  uint8_t deviceType;       // VictronDeviceType
+  char name[16];
+} provisionedEntry;
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;          // PROVISION_VERSION
+  uint8_t count;
+  uint8_t generation[MAX_DEVICES];  // Every slot's, holes included
+  provisionedEntry entries[MAX_DEVICES];
+} provisionBlob;
+
+#define PROVISION_HEADER_SIZE  offsetof(provisionBlob, entries)
+
+// Backing store of the enrolled slots: slot victronDeviceCount + i
+victronDevice provisionedDevices[MAX_DEVICES];
+char provisionedNames[MAX_DEVICES][16];
+const victronDevice freeSlot = { {}, {}, "(free)", DEVICE_SOLAR_CHARGER };
+
+bool saveProvisionedDevices() {
+  provisionBlob blob = { PROVISION_VERSION, 0 };
+  memcpy(blob.generation, deviceStore.generation, sizeof(blob.generation));
+  for (int i = victronDeviceCount; i < deviceCount(); i++) {
+    if (deviceStore.retired[i]) continue;
+    provisionedEntry* e = &blob.entries[blob.count++];
+    e->slot = i;
+    memcpy(e->mac, device(i).byteMacAddr.b, sizeof(e->mac));
+    memcpy(e->key, device(i).byteKey.b, sizeof(e->key));
+    e->deviceType = device(i).deviceType;
+    strncpy(e->name, device(i).comment, sizeof(e->name));
+  }
+  
+  Preferences prefs;
+  if (!prefs.begin(PROVISION_NAMESPACE, false)) return false;
+  size_t size = PROVISION_HEADER_SIZE + blob.count * sizeof(provisionedEntry);
+  bool ok = prefs.putBytes(PROVISION_BLOB, &blob, size) == size;
+  prefs.end();
+  return ok;
+}
+
+// Lowest free slot: a hole left at boot by a deleted device, else the end.
+// Slots deleted since boot stay retired until the next restart.
+int findFreeSlot() {
+  for (int i = victronDeviceCount; i < deviceCount(); i++) {
+    if (deviceTable[i] == &freeSlot) return i;
+  }
+  return deviceCount() < MAX_DEVICES ? deviceCount() : -1;
+}
+
+// Fills `slot` (a hole or past the end); the caller publishes the MAC index
+bool fillSlot(int slot, const byte* mac, const byte* key, VictronDeviceType type, const char* name) {
+  victronDevice* d = &provisionedDevices[slot - victronDeviceCount];
+  char* storedName = provisionedNames[slot - victronDeviceCount];
+  memcpy(d->byteMacAddr.b, mac, 6);
+  memcpy(d->byteKey.b, key, 16);
+  strncpy(storedName, name, 15);
+  storedName[15] = '\0';
+  d->comment = storedName;
+  d->deviceType = type;
+  
+  // Holes up to the slot; none of them is in the MAC index
+  for (int i = deviceCount(); i < slot; i++) {
+    deviceTable[i] = &freeSlot;
+    deviceStore.retired[i] = true;
+  }
+  // The slot is unreachable until the index is published: reset it freely
+  deviceStore.recordType[slot] = 0;
+  deviceStore.validMask[slot] = 0;
+  deviceStore.retired[slot] = true;
+  deviceTable[slot] = d;
+  if (!initDeviceCipher(slot)) return false;
+  deviceStore.retired[slot] = false;
+  if (slot >= deviceCount()) deviceTableSize.store(slot + 1, std::memory_order_release);
+  return true;
+}
+
+// Boot: one blob read, then one index build for all enrolled devices
+void loadProvisionedDevices() {
+  Preferences prefs;
+  if (!prefs.begin(PROVISION_NAMESPACE, true)) return;  // Nothing saved yet
+  provisionBlob blob;
+  size_t size = prefs.getBytes(PROVISION_BLOB, &blob, sizeof(blob));
+  prefs.end();
+  
+  if (size < PROVISION_HEADER_SIZE || blob.version != PROVISION_VERSION || blob.count > MAX_DEVICES ||
+      size != PROVISION_HEADER_SIZE + blob.count * sizeof(provisionedEntry)) {
+    if (size > 0) logPrintf(LOG_LEVEL_WARN, "[PROVISION] stored device list ignored (bad format)\n");
+    return;
+  }
+  for (int i = victronDeviceCount; i < MAX_DEVICES; i++) deviceStore.generation[i] = blob.generation[i];
+  
+  // Stored slots first, so entries that must move only take what is left
+  int loaded = 0;
+  bool placed[MAX_DEVICES] = {};
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < blob.count; i++) {
+      const provisionedEntry* e = &blob.entries[i];
+      if (placed[i]) continue;
+      char name[17] = {0};
+      memcpy(name, e->name, 16);
+      // A MAC since added to victronDevices[] wins over the stored entry
+      if (findDeviceByMac(e->mac) != -1 || e->deviceType > DEVICE_SMART_LITHIUM) {
+        placed[i] = true;
+        continue;
       }
+      int slot = e->slot;
+      bool own = slot >= victronDeviceCount && slot < MAX_DEVICES &&
+                 (slot >= deviceCount() || deviceTable[slot] == &freeSlot);
+      if (pass == 0 && !own) continue;
+      if (pass == 1) {
+        // victronDevices[] grew over it: a new slot, so a new generation
+        slot = findFreeSlot();
+        if (slot < 0) break;
+        deviceStore.generation[slot]++;
+        logPrintf(LOG_LEVEL_WARN, "[PROVISION] %s moved from slot %d to %d\n", name, e->slot, slot);
+      }
+      if (!fillSlot(slot, e->mac, e->key, (VictronDeviceType)e->deviceType, name)) continue;
+      placed[i] = true;
+      loaded++;
+    }
+  }
+  if (loaded > 0) publishMacIndex();
+  logPrintf(LOG_LEVEL_INFO, "[PROVISION] %d enrolled device(s) loaded\n", loaded);
+}
+
+// True if `hex` holds exactly `bytes` bytes of hex digits (':' allowed)
+bool isHexOfLength(const char* hex, size_t bytes) {
+  size_t digits = 0;
+  for (; *hex != '\0'; hex++) {
+    if (hexNibble(*hex) != 0xFF) {
+      digits++;
+    } else if (*hex != ':') {
+      return false;
+    }
+  }
+  return digits == 2 * bytes;
+}
+
+// Serial: add <mac> <key> <type> [name]
+void provisionAdd(const char* macArg, const char* keyArg, const char* typeArg, const char* nameArg) {
+  if (macArg == nullptr || keyArg == nullptr || typeArg == nullptr) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] usage: add <mac> <key> <type> [name]\n");
+    return;
+  }
+  if (!isHexOfLength(macArg, 6) || !isHexOfLength(keyArg, 16)) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] MAC must be 12 hex digits, key 32\n");
+    return;
+  }
+  int type = -1;
+  for (int t = 0; t <= DEVICE_SMART_LITHIUM; t++) {
+    if (strcasecmp(typeArg, deviceTypeNames[t]) == 0) type = t;
+  }
+  if (type < 0) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] type must be one of: Solar Shunt BattSense Inverter DC-DC Lithium\n");
+    return;
+  }
+  hexBytes<6> mac = parseHex<6>(macArg);
+  hexBytes<16> key = parseHex<16>(keyArg);
+  if (findDeviceByMac(mac) != -1) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] %s is already configured\n", macArg);
+    return;
+  }
+  
+  int slot = findFreeSlot();
+  if (slot < 0) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] no free slot (max %d, deleted slots free up at restart)\n", MAX_DEVICES);
+    return;
+  }
+  char name[16];
+  if (nameArg != nullptr) {
+    strncpy(name, nameArg, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+  } else {
+    snprintf(name, sizeof(name), "%s%d", deviceTypeNames[type], slot);
+  }
+  deviceStore.generation[slot]++;
+  if (!fillSlot(slot, mac, key, (VictronDeviceType)type, name)) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] AES key setup failed\n");
+    return;
+  }
+  publishMacIndex();
+  bool saved = saveProvisionedDevices();
+  logPrintf(LOG_LEVEL_ERROR, "[PROVISION] [%d] %s %s added%s; history starts after the next restart\n",
+    slot, name, deviceTypeNames[type], saved ? "" : " (NVS write failed, lost at restart)");
+}
+
+// Serial: del <mac>
+void provisionDelete(const char* macArg) {
+  if (macArg == nullptr || !isHexOfLength(macArg, 6)) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] usage: del <mac>\n");
+    return;
+  }
+  int slot = findDeviceByMac(parseHex<6>(macArg));
+  if (slot < 0) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] %s is not configured\n", macArg);
+    return;
+  }
+  if (slot < victronDeviceCount) {
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] %s is built in: edit victronDevices[]\n", device(slot).comment);
+    return;
+  }
+  deviceStore.retired[slot] = true;
+  publishMacIndex();
+  retireRequests.fetch_or(1u << slot, std::memory_order_release);
+  if (workerTaskHandle) xTaskNotifyGive(workerTaskHandle);
+  bool saved = saveProvisionedDevices();
+  logPrintf(LOG_LEVEL_ERROR, "[PROVISION] %s deleted%s\n",
+    device(slot).comment, saved ? "" : " (NVS write failed)");
+}
+
+// Serial: devices
+void provisionList() {
+  for (int i = 0; i < deviceCount(); i++) {
+    if (deviceTable[i] == &freeSlot) continue;
+    const byte* mac = device(i).byteMacAddr;
+    logPrintf(LOG_LEVEL_ERROR, "[PROVISION] [%d] %-15s %-9s MAC:%02x%02x%02x%02x%02x%02x %s\n", i,
+      device(i).comment, deviceTypeNames[device(i).deviceType], mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+      deviceStore.retired[i] ? "deleted" : (i < victronDeviceCount ? "built-in" : "nvs"));
+  }
+}
+
+// ============================================================================
+// Packet Queue (BLE callback -> worker task)
+// ============================================================================
+// Single-producer / single-consumer ring: the Bluedroid callback only copies
+// the raw advertisement in, the worker task does everything else.
+#define PACKET_QUEUE_SIZE       16    // Must be a power of two
+#define MANUFACTURER_DATA_MAX   31
+
+typedef struct {
+  uint8_t mac[6];
+  int8_t rssi;
+  int8_t deviceIndex;                 // Slot in victronDevices[], -1 = unknown
+  uint8_t length;                     // Bytes used in data[]
+  uint8_t source;                     // Mesh node that heard it, 0 = this one
+  uint8_t data[MANUFACTURER_DATA_MAX + 1];  // +1 keeps victronManufacturerData in bounds
+} rawPacket;
+
+// One producer and one consumer per ring; the mesh uses the same type for
+// its inbox (Wi-Fi task -> worker) and outbox (BLE task -> loop)
+struct packetRing {
+  rawPacket slots[PACKET_QUEUE_SIZE];
+  std::atomic<uint32_t> head;         // Written by the producer only
+  std::atomic<uint32_t> tail;         // Written by the consumer only
+  std::atomic<uint32_t> dropped;      // Packets lost because the ring was full
+};
+
+packetRing packetQueue;
+
+// Producer side. Returns a slot to fill, or nullptr if full.
+rawPacket* packetQueueReserve(packetRing& ring) {
+  uint32_t head = ring.head.load(std::memory_order_relaxed);
+  uint32_t tail = ring.tail.load(std::memory_order_acquire);
+  if (head - tail >= PACKET_QUEUE_SIZE) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  return &ring.slots[head & (PACKET_QUEUE_SIZE - 1)];
+}
+
+// Publishes the reserved slot; returns the ring depth
+uint32_t packetQueueCommit(packetRing& ring) {
+  uint32_t head = ring.head.fetch_add(1, std::memory_order_release) + 1;
+  return head - ring.tail.load(std::memory_order_relaxed);
+}
+
+// Consumer side
+bool packetQueuePop(packetRing& ring, rawPacket* out) {
+  uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+  uint32_t head = ring.head.load(std::memory_order_acquire);
+  if (tail == head) return false;
+  *out = ring.slots[tail & (PACKET_QUEUE_SIZE - 1)];
+  ring.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// ============================================================================
+// ESP-NOW Mesh
+// ============================================================================
+// Scanner nodes forward each new reading they hear once (first copy per MAC
+// and nonce), still encrypted, so they need no keys for devices they do
+// not show themselves. Records are batched into one ESP-NOW frame per
+// MESH_BATCH_MS. The display node queues the records of its own devices
+// behind the local scan; processPacket() drops the repeats and keeps the
+// receiver with the best RSSI.
+//
+// Frame: magic, version, node id, record count, then per record the MAC,
+// RSSI, data length and the manufacturer data as received (packed).
+#if MESH_ROLE
+typedef struct {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t node;
+  uint8_t count;
+} __attribute__((packed)) meshFrameHeader;
+
+typedef struct {
+  uint8_t mac[6];
+  int8_t rssi;
+  uint8_t length;                     // Manufacturer data bytes that follow
+} __attribute__((packed)) meshRecordHeader;
+
+#define MESH_RECORD_MAX  (sizeof(meshRecordHeader) + MANUFACTURER_DATA_MAX)
+static_assert(sizeof(meshFrameHeader) + MESH_RECORD_MAX <= MESH_FRAME_MAX, "a record must fit a frame");
+
+struct {
+  std::atomic<uint32_t> frames;       // Sent (scanner) or accepted (display)
+  std::atomic<uint32_t> records;
+  std::atomic<uint32_t> failed;       // Scanner: not acknowledged; display: malformed
+  std::atomic<uint32_t> foreign;      // Display: records of devices not configured here
+  std::atomic<uint32_t> outboxFull;   // Scanner: readings not queued, retried on their next repeat
+} meshStats;
+
+#if MESH_ROLE == MESH_SCANNER
+constexpr hexBytes<6> meshPeer = configMac(MESH_PEER);
+
+packetRing meshOutbox;                // BLE task -> loop()
+
+// BLE task only: last nonce forwarded per MAC, for every Victron MAC in
+// range (foreign ones too: the display node may have their keys). Set
+// associative, so a crowded site with hundreds of devices does not evict
+// entries before their repeats arrive; the least recently heard MAC of a
+// full set makes room. An eviction of a live entry means repeats of that
+// device get forwarded again, and is counted.
+static_assert((MESH_SEEN_SIZE & (MESH_SEEN_SIZE - 1)) == 0 && MESH_SEEN_SIZE % MESH_SEEN_WAYS == 0,
+              "MESH_SEEN_SIZE must be a power of two and a multiple of MESH_SEEN_WAYS");
+
+struct {
+  uint64_t mac[MESH_SEEN_SIZE];       // Packed MAC, 0 = free
+  uint32_t heardMs[MESH_SEEN_SIZE];
+  uint16_t nonce[MESH_SEEN_SIZE];
+  std::atomic<uint32_t> evictions;    // Of entries heard within MESH_SEEN_LIVE_MS
+} meshSeen;
+
+// loop() only: the frame being filled
+struct {
+  uint8_t data[MESH_FRAME_MAX];
+  size_t length;
+  uint8_t count;
+  uint32_t openedMs;
+} meshBatch = { {}, sizeof(meshFrameHeader) };
+
+// BLE task, for every Victron advertisement: copies the first one of each
+// reading into the outbox
+void meshForward(const uint8_t* mac, int rssi, const uint8_t* manData, int length) {
+  if (length < VICTRON_HEADER_SIZE) return;
+  uint16_t nonce = ((const victronManufacturerData*)manData)->nonceDataCounter;
+  uint64_t key = packMac(mac);
+  uint32_t now = millis();
+  uint32_t set = macHash(key) & (MESH_SEEN_SIZE - 1) & ~(MESH_SEEN_WAYS - 1);
+  uint32_t slot = set;
+  bool found = false;
+  for (uint32_t i = set; i < set + MESH_SEEN_WAYS; i++) {
+    if (meshSeen.mac[i] == key) {
+      slot = i;
+      found = true;
+      break;
+    }
+    // Otherwise a free way, else the one heard longest ago
+    if (meshSeen.mac[slot] != 0 && (meshSeen.mac[i] == 0 || now - meshSeen.heardMs[i] > now - meshSeen.heardMs[slot])) {
+      slot = i;
+    }
+  }
+  if (found) {
+    meshSeen.heardMs[slot] = now;
+    if (meshSeen.nonce[slot] == nonce) return;
+  }
+  
+  rawPacket* pkt = packetQueueReserve(meshOutbox);
+  if (pkt == nullptr) {
+    meshStats.outboxFull.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (length > MANUFACTURER_DATA_MAX) length = MANUFACTURER_DATA_MAX;
+  memcpy(pkt->data, manData, length);
+  pkt->length = length;
+  memcpy(pkt->mac, mac, 6);
+  pkt->rssi = rssi;
+  packetQueueCommit(meshOutbox);
+  
+  // Only a queued reading is remembered: the repeats of one the outbox
+  // had no room for get their chance
+  if (!found && meshSeen.mac[slot] != 0 && now - meshSeen.heardMs[slot] < MESH_SEEN_LIVE_MS) {
+    meshSeen.evictions.fetch_add(1, std::memory_order_relaxed);
+  }
+  meshSeen.mac[slot] = key;
+  meshSeen.nonce[slot] = nonce;
+  meshSeen.heardMs[slot] = now;
+}
+
+// Wi-Fi task: MAC-layer result of a unicast frame (broadcasts always succeed)
+void meshSent(const uint8_t* mac, esp_now_send_status_t status) {
+  if (status != ESP_NOW_SEND_SUCCESS) meshStats.failed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void meshSendBatch() {
+  meshFrameHeader* header = (meshFrameHeader*)meshBatch.data;
+  header->magic = MESH_MAGIC;
+  header->version = MESH_VERSION;
+  header->node = MESH_NODE_ID;
+  header->count = meshBatch.count;
+  esp_err_t err = esp_now_send(meshPeer, meshBatch.data, meshBatch.length);
+  if (err == ESP_OK) {
+    meshStats.frames.fetch_add(1, std::memory_order_relaxed);
+    meshStats.records.fetch_add(meshBatch.count, std::memory_order_relaxed);
+  } else {
+    meshStats.failed.fetch_add(1, std::memory_order_relaxed);
+    logPrintf(LOG_LEVEL_DEBUG, "[MESH] send failed (%d), %u records lost\n", err, meshBatch.count);
+  }
+  meshBatch.length = sizeof(meshFrameHeader);
+  meshBatch.count = 0;
+}
+
+// Called from loop(): moves outbox records into the frame, which goes out
+// once it has no room for another record or its first record is
+// MESH_BATCH_MS old
+void serviceMesh() {
+  uint32_t now = millis();
+  rawPacket pkt;
+  while (meshBatch.length + MESH_RECORD_MAX <= MESH_FRAME_MAX && packetQueuePop(meshOutbox, &pkt)) {
+    if (meshBatch.count == 0) meshBatch.openedMs = now;
+    meshRecordHeader record;
+    memcpy(record.mac, pkt.mac, 6);
+    record.rssi = pkt.rssi;
+    record.length = pkt.length;
+    memcpy(meshBatch.data + meshBatch.length, &record, sizeof(record));
+    memcpy(meshBatch.data + meshBatch.length + sizeof(record), pkt.data, pkt.length);
+    meshBatch.length += sizeof(record) + pkt.length;
+    meshBatch.count++;
+  }
+  if (meshBatch.count == 0) return;
+  if (meshBatch.length + MESH_RECORD_MAX > MESH_FRAME_MAX || now - meshBatch.openedMs >= MESH_BATCH_MS) {
+    meshSendBatch();
+  }
+}
+#endif
+
+#if MESH_ROLE == MESH_DISPLAY
+packetRing meshInbox;                 // Wi-Fi task -> worker
+
+// Wi-Fi task: unpacks a frame. Only devices configured here can be
+// decrypted; the scanner that heard the others logs them itself.
+void meshReceive(const uint8_t* from, const uint8_t* data, int length) {
+  meshFrameHeader header;
+  if (length < (int)sizeof(header)) return;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != MESH_MAGIC || header.version != MESH_VERSION || header.node == 0) {
+    meshStats.failed.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  meshStats.frames.fetch_add(1, std::memory_order_relaxed);
+  
+  int offset = sizeof(header);
+  bool queued = false;
+  for (uint8_t i = 0; i < header.count; i++) {
+    meshRecordHeader record;
+    if (offset + (int)sizeof(record) > length) break;
+    memcpy(&record, data + offset, sizeof(record));
+    offset += sizeof(record);
+    if (record.length > MANUFACTURER_DATA_MAX || offset + record.length > length) {
+      meshStats.failed.fetch_add(1, std::memory_order_relaxed);
+      break;
+    }
+    const uint8_t* manData = data + offset;
+    offset += record.length;
+    meshStats.records.fetch_add(1, std::memory_order_relaxed);
+    
+    int deviceIndex = findDeviceByMac(record.mac);
+    if (deviceIndex == -1) {
+      meshStats.foreign.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    rawPacket* pkt = packetQueueReserve(meshInbox);
+    if (pkt == nullptr) continue;
+    memset(pkt->data, 0, sizeof(pkt->data));
+    memcpy(pkt->data, manData, record.length);
+    pkt->length = record.length;
+    memcpy(pkt->mac, record.mac, 6);
+    pkt->rssi = record.rssi;
+    pkt->deviceIndex = deviceIndex;
+    pkt->source = header.node;
+    packetQueueCommit(meshInbox);
+    queued = true;
+  }
+  if (queued && workerTaskHandle) xTaskNotifyGive(workerTaskHandle);
+}
+#endif
+
+// Station mode without an access point: ESP-NOW only needs the radio up
+// on the shared channel. With the MQTT bridge the AP dictates the channel.
+void startMesh() {
+  WiFi.mode(WIFI_STA);
+  esp_coex_preference_set(ESP_COEX_PREFER_BT);
+  if (!MQTT_BRIDGE) esp_wifi_set_channel(MESH_CHANNEL, WIFI_SECOND_CHAN_NONE);
+  if (esp_now_init() != ESP_OK) {
+    logPrintf(LOG_LEVEL_ERROR, "[MESH] ESP-NOW init failed\n");
+    return;
+  }
+#if MESH_ROLE == MESH_SCANNER
+  esp_now_peer_info_t peer = {};
+  memcpy(peer.peer_addr, meshPeer.b, 6);
+  peer.channel = 0;                   // Whatever channel the radio is on
+  peer.ifidx = WIFI_IF_STA;
+  if (esp_now_add_peer(&peer) != ESP_OK) logPrintf(LOG_LEVEL_ERROR, "[MESH] cannot add peer " MESH_PEER "\n");
+  esp_now_register_send_cb(meshSent);
+#else
+  esp_now_register_recv_cb(meshReceive);
+#endif
+  uint8_t mac[6];
+  esp_wifi_get_mac(WIFI_IF_STA, mac);
+  logPrintf(LOG_LEVEL_INFO, "[MESH] %s node %u, channel %d, MAC:%02x%02x%02x%02x%02x%02x\n",
+    MESH_ROLE == MESH_SCANNER ? "scanner" : "display", MESH_ROLE == MESH_SCANNER ? MESH_NODE_ID : 0,
+    MESH_CHANNEL, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+// Serial: mesh
+void meshCommand() {
+  uint32_t frames = meshStats.frames.load(std::memory_order_relaxed);
+  uint32_t records = meshStats.records.load(std::memory_order_relaxed);
+  uint32_t failed = meshStats.failed.load(std::memory_order_relaxed);
+#if MESH_ROLE == MESH_SCANNER
+  logPrintf(LOG_LEVEL_ERROR, "[MESH] scanner %u -> " MESH_PEER ": frames:%u records:%u unacked:%u outboxFull:%u evictions:%u\n",
+    MESH_NODE_ID, frames, records, failed, meshStats.outboxFull.load(std::memory_order_relaxed),
+    meshSeen.evictions.load(std::memory_order_relaxed));
+#else
+  logPrintf(LOG_LEVEL_ERROR, "[MESH] display: frames:%u records:%u malformed:%u foreign:%u dropped:%u\n",
+    frames, records, failed, meshStats.foreign.load(std::memory_order_relaxed),
+    meshInbox.dropped.load(std::memory_order_relaxed));
+#endif
+}
+#endif
+
+// ============================================================================
+// Packet Processing (worker task)
+// ============================================================================
+// Averages the time between two decoded readings. A gap of more than twice
+// the estimate spans a missed reading and is left out.
+void learnUpdatePeriod(int deviceIndex, uint32_t gap) {
+  uint16_t& period = deviceStore.updatePeriodMs[deviceIndex];
+  uint8_t& samples = deviceStore.periodSamples[deviceIndex];
+  if (gap > UINT16_MAX) return;
+  if (samples == 0) {
+    period = gap;
+  } else if (gap < 2u * period) {
+    uint16_t& jitter = deviceStore.jitterMs[deviceIndex];
+    jitter += ((int32_t)abs((int32_t)gap - period) - jitter) / 8;
+    period += ((int32_t)gap - period) / 4;
+  } else {
+    return;
+  }
+  if (samples < UINT8_MAX) samples++;
+}
+
+// Updates last-seen time and RSSI; returns true if the frame is a repeat.
+// With mesh nodes, the same reading arrives from several receivers: a copy
+// from another source only counts if it was heard better, and that source
+// then becomes the device's. Batching lets an older reading arrive after a
+// newer one; a nonce up to LINK_NONCE_BEHIND_MAX behind is a repeat too.
+bool refreshLinkStats(int deviceIndex, int rssi, uint16_t nonce, uint8_t source) {
+  int16_t behind = (int16_t)(deviceStore.nonce[deviceIndex] - nonce);
+  bool repeat = deviceHasData(deviceIndex) && behind >= 0 && behind <= LINK_NONCE_BEHIND_MAX;
+  deviceStore.lastSeenMs[deviceIndex] = millis();
+  if (repeat && behind > 0) return true;
+  if (repeat && source != deviceStore.source[deviceIndex]) {
+    if (rssi <= deviceStore.rssi[deviceIndex]) return true;
+    logPrintf(LOG_LEVEL_DEBUG, "[MESH] %s now via node %u (%d dBm)\n", device(deviceIndex).comment, source, rssi);
+  }
+  deviceStore.source[deviceIndex] = source;
+  deviceStore.rssi[deviceIndex] = rssi;
+  int16_t& avg = deviceStore.rssiAvg[deviceIndex];
+  avg = (avg == 0) ? rssi * 16 : avg + (rssi * 16 - avg) / 8;
+  return repeat;
+}
+
+// nonceDataCounter advances by one per reading, so a jump of n means n - 1
+// readings were never received: the loss of this receiver position
+void trackNonceGap(int deviceIndex, uint16_t nonce) {
+  if (!deviceHasData(deviceIndex)) return;
+  uint16_t gap = nonce - deviceStore.nonce[deviceIndex];
+  if (gap == 0 || gap > LINK_NONCE_GAP_MAX) return;
+  uint16_t& received = deviceStore.noncesReceived[deviceIndex];
+  uint16_t& missed = deviceStore.noncesMissed[deviceIndex];
+  received++;
+  missed += gap - 1;
+  if (received + missed >= LINK_LOSS_WINDOW) {
+    received /= 2;
+    missed /= 2;
+  }
+}
+
+// Share of recent readings lost, 0..1000
+uint16_t linkLossPermille(int deviceIndex) {
+  uint32_t total = deviceStore.noncesReceived[deviceIndex] + deviceStore.noncesMissed[deviceIndex];
+  return total ? deviceStore.noncesMissed[deviceIndex] * 1000 / total : 0;
+}
+
+// Worker: returns true if a device shown on the current page went stale
+// or came back since the last call
+bool refreshStaleDevices(uint32_t now) {
+  uint32_t stale = 0;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (deviceStore.retired[i] || !deviceHasData(i)) continue;
+    if (now - deviceStore.lastSeenMs[i] >= DEVICE_STALE_MS) stale |= 1u << i;
+  }
+  uint32_t changed = stale ^ staleDevices;
+  staleDevices = stale;
+  bool visible = false;
+  for (int i = 0; changed != 0 && i < deviceCount(); i++) {
+    if (!(changed & (1u << i)) || deviceStore.retired[i]) continue;
+    logPrintf(LOG_LEVEL_INFO, "[LINK] %s %s\n", device(i).comment, (stale & (1u << i)) ? "stale" : "back");
+    if (pageShowsDevice(i)) visible = true;
+  }
+  return visible;
+}
+
+// Serial: link
+void linkCommand() {
+  uint32_t now = millis();
+  for (int i = 0; i < deviceCount(); i++) {
+    if (deviceStore.retired[i]) continue;
+    if (!deviceHasData(i)) {
+      logPrintf(LOG_LEVEL_ERROR, "[LINK] [%d] %-15s never seen\n", i, device(i).comment);
+      continue;
+    }
+    uint16_t loss = linkLossPermille(i);
+    char source[10] = "local";
+    if (deviceStore.source[i] != 0) snprintf(source, sizeof(source), "node %u", deviceStore.source[i]);
+    logPrintf(LOG_LEVEL_ERROR, "[LINK] [%d] %-15s seen:%us ago via %s rssi:%ddBm (avg %s) period:%ums jitter:%ums loss:%u.%u%%%s\n",
+      i, device(i).comment, (now - deviceStore.lastSeenMs[i]) / 1000, source, deviceStore.rssi[i],
+      fixedToText(deviceStore.rssiAvg[i] * 10 / 16, 1, 1).s, deviceStore.updatePeriodMs[i], deviceStore.jitterMs[i],
+      loss / 10, loss % 10, (staleDevices & (1u << i)) ? " STALE" : "");
+  }
+}
+
+// Returns true if the packet updated data shown on the current page
+bool processPacket(const rawPacket* pkt) {
+  victronManufacturerData* vicData = (victronManufacturerData*)pkt->data;
+  int manDataSize = pkt->length;
+  
+  int deviceIndex = pkt->deviceIndex;
+  
+  // Handle unknown devices - log them for configuration
+  if (deviceIndex == -1) {
+    // Each unknown Victron MAC is queued once (negative cache in onResult)
+    logPrintf(LOG_LEVEL_INFO, "[NEW DEVICE] Type:0x%02X MAC:%02x%02x%02x%02x%02x%02x - enroll: add <mac> <key> <type> [name]\n",
+      vicData->victronRecordType,
+      pkt->mac[0], pkt->mac[1], pkt->mac[2], pkt->mac[3], pkt->mac[4], pkt->mac[5]);
+    return false;
+  }
+  // Deleted while the packet was queued
+  if (deviceStore.retired[deviceIndex]) return false;
+  
+  const char* deviceName = device(deviceIndex).comment;
+  int rssi = pkt->rssi;
+  
+  // Victron re-broadcasts each payload until nonceDataCounter moves on:
+  // a repeat only refreshes link stats, it is not decrypted again
+  if (refreshLinkStats(deviceIndex, rssi, vicData->nonceDataCounter, pkt->source)) {
+    return false;
+  }
+  
+  // Verify encryption key
+  if (vicData->encryptKeyMatch != device(deviceIndex).byteKey[0]) {
+    perfCount(perf.keyMismatches);
+    logPrintf(LOG_LEVEL_WARN, "[KEY MISMATCH] %s - check encryption key!\n", deviceName);
+    return false;
+  }
+  
+  // Decrypt data
+  byte outputData[RECORD_BUFFER_SIZE] = {0};
+  uint32_t decryptStart = perfNow();
+  bool decrypted = victronDecrypt(&deviceStore.aesCtx[deviceIndex], vicData, outputData, manDataSize - VICTRON_HEADER_SIZE);
+  perfRecord(PERF_DECRYPT, decryptStart);
+  if (!decrypted) {
+    logPrintf(LOG_LEVEL_ERROR, "[DECRYPT FAIL] %s\n", deviceName);
+    return false;
+  }
+  // Battery Sense sends battery monitor records whatever type byte it uses
+  uint8_t recordType = vicData->victronRecordType;
+  if (device(deviceIndex).deviceType == DEVICE_BATTERY_SENSE) recordType = VICTRON_TYPE_BATTERY_MONITOR;
+  
+  const recordLayout* layout = findRecordLayout(recordType);
+  if (layout == nullptr) {
+    logPrintf(LOG_LEVEL_WARN, "[UNKNOWN TYPE] 0x%02X from %s\n", vicData->victronRecordType, deviceName);
+    return false;
+  }
+  // Another record type than the configured device sends (wrong type in
+  // the table or at enrollment) must not overwrite its pages and totals
+  if (recordType != deviceRecordTypes[device(deviceIndex).deviceType]) {
+    logPrintf(LOG_LEVEL_DEBUG, "[TYPE MISMATCH] 0x%02X from %s (%s), ignored\n",
+      vicData->victronRecordType, deviceName, deviceTypeNames[device(deviceIndex).deviceType]);
+    return false;
+  }
+  if (!recordPlausible(outputData, layout)) {
+    logPrintf(LOG_LEVEL_WARN, "[BAD FRAME] %s - unused bits set, frame ignored\n", deviceName);
+    return false;
+  }
+
+  // Keep what the processors compare against, then store the new frame
+  int32_t previous[RECORD_FIELDS_MAX];
+  memcpy(previous, deviceStore.value[deviceIndex], sizeof(previous));
+  uint32_t previousValid = deviceStore.validMask[deviceIndex];
+  trackNonceGap(deviceIndex, vicData->nonceDataCounter);
+  
+  uint32_t decodeStart = perfNow();
+  deviceStore.validMask[deviceIndex] = decodeRecord(outputData, layout, deviceStore.value[deviceIndex]);
+  perfRecord(PERF_DECODE, decodeStart);
+  deviceStore.recordType[deviceIndex] = recordType;
+  deviceStore.nonce[deviceIndex] = vicData->nonceDataCounter;
+  if (previousValid != 0) {
+    learnUpdatePeriod(deviceIndex, deviceStore.lastSeenMs[deviceIndex] - deviceStore.lastUpdateMs[deviceIndex]);
+  }
+  deviceStore.lastUpdateMs[deviceIndex] = deviceStore.lastSeenMs[deviceIndex];
+  packetReceived = true;
+  updateAggregates(deviceIndex, previous, previousValid);
+  historyRecord(deviceIndex);
+  if (device(deviceIndex).deviceType == DEVICE_SOLAR_CHARGER) storageTrackSolarDay(deviceIndex);
+  
+  // Process based on configured device type
+  switch (device(deviceIndex).deviceType) {
+    case DEVICE_SOLAR_CHARGER:
+      processSolarCharger(deviceIndex, previous, previousValid);
+      return pageShowsDevice(deviceIndex);
+      
+    case DEVICE_SMART_SHUNT:
+      processSmartShunt(deviceIndex, previous, previousValid);
+      return pageShowsDevice(deviceIndex);
+      
+    case DEVICE_BATTERY_SENSE:
+      processBatterySense(deviceIndex);
+      return pageShowsDevice(deviceIndex);
+      
+    case DEVICE_INVERTER:
+    case DEVICE_DCDC_CONVERTER:
+    case DEVICE_SMART_LITHIUM:
+      processGenericRecord(deviceIndex, layout);
+      return false;
+  }
+  return false;
+}
+
+// Drains the packet queue, decodes and renders. Pinned to the application
+// core so the Bluedroid host task (protocol core) never waits on AES or SPI.
+void packetWorkerTask(void* param) {
+  rawPacket pkt;
+  uint32_t reportedDrops = 0;
+  TickType_t lastRender = 0;
+  
+  // Mounting LittleFS and reloading the history takes a while: done here,
+  // with the scan already running, instead of in setup()
+  initStorage();
+  
+  for (;;) {
+    // Sleep until new packets arrive, or until the pending frame is due
+    TickType_t wait = pdMS_TO_TICKS(WORKER_IDLE_MS);
+    if (renderPending && !displayBlanked) {
+      TickType_t elapsed = xTaskGetTickCount() - lastRender;
+      wait = (elapsed >= pdMS_TO_TICKS(DISPLAY_FRAME_MS)) ? 0 : pdMS_TO_TICKS(DISPLAY_FRAME_MS) - elapsed;
     }
+    ulTaskNotifyTake(pdTRUE, wait);
     
-    // Handle unknown devices - log them for configuration
-    if (deviceIndex == -1) {
-      // Log ALL Victron devices for debugging
-      Serial.printf("[NEW DEVICE] Type:0x%02X Name:%s MAC:%s\n", 
-        vicData->victronRecordType, deviceName, macStr);
-      return;
+    while (packetQueuePop(packetQueue, &pkt)) {
+      renderPending |= processPacket(&pkt);
+    }
+#if MESH_ROLE == MESH_DISPLAY
+    while (packetQueuePop(meshInbox, &pkt)) {
+      renderPending |= processPacket(&pkt);
     }
+#endif
+    if (releaseRetiredDevices()) renderPending = true;
+    if (refreshStaleDevices(millis())) renderPending = true;
+    if (historyTick(millis())) {
+      storageQueueBuckets();
+      if (pageShowsHistory()) renderPending = true;
+    }
+#if MQTT_BRIDGE
+    mqttCollect(millis());
+#endif
     
-    // Verify encryption key
-    if (vicData->encryptKeyMatch != victronDevices[deviceIndex].byteKey[0]) {
-      Serial.printf("[KEY MISMATCH] %s - check encryption key!\n", deviceName);
-      return;
+    uint32_t drops = packetQueue.dropped.load(std::memory_order_relaxed);
+    if (drops != reportedDrops) {
+      logPrintf(LOG_LEVEL_WARN, "[QUEUE] %u packets dropped\n", drops - reportedDrops);
+      reportedDrops = drops;
+      perf.dropped = drops;
     }
     
-    // Decrypt data
-    byte outputData[16] = {0};
-    int encrDataSize = manDataSize - 10;
-    if (!decryptVictronData(vicData, deviceIndex, outputData, encrDataSize)) {
-      Serial.printf("[DECRYPT FAIL] %s\n", deviceName);
-      return;
+    if (displayRefreshRequested) {
+      displayRefreshRequested = false;
+      renderPending = true;
+      renderUrgent = true;
+    }
+    
+    TickType_t now = xTaskGetTickCount();
+    // While blanked the frame stays pending and is drawn on wake
+    if (renderPending && !displayBlanked && (renderUrgent || now - lastRender >= pdMS_TO_TICKS(DISPLAY_FRAME_MS))) {
+      uint32_t drawStart = perfNow();
+      updateDisplay();
+      perfRecord(PERF_DISPLAY, drawStart);
+      lastRender = now;
+      renderPending = false;
     }
+    // Urgency only counts for data that reached the visible page
+    renderUrgent = false;
+  }
+}
+
+// Called from loop() (buttons, idle tick, wake) - the worker owns the display
+void requestDisplayRefresh() {
+  displayRefreshRequested = true;
+  if (workerTaskHandle) xTaskNotifyGive(workerTaskHandle);
+}
+
+// ============================================================================
+// BLE Callback
+// ============================================================================
+// Registered with shouldParse = false: the stack hands over the raw payload
+// and the by-value BLEAdvertisedDevice carries no parsed strings, so nothing
+// here touches the heap. Non-Victron traffic is rejected on the first pass.
+class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks {
+  void onResult(BLEAdvertisedDevice advertisedDevice) {
+    uint32_t start = perfNow();
+    perfCount(perf.adverts);
+    captureAdvertisement(*advertisedDevice.getAddress().getNative(), advertisedDevice.getRSSI(),
+                         advertisedDevice.getPayload(), advertisedDevice.getPayloadLength());
+    queueAdvertisement(advertisedDevice);
+    perfRecord(PERF_CALLBACK, start);
+  }
+  
+  void queueAdvertisement(BLEAdvertisedDevice& advertisedDevice) {
+    int manDataSize;
+    const uint8_t* manData = findVictronManufacturerData(advertisedDevice.getPayload(),
+                                                         advertisedDevice.getPayloadLength(), &manDataSize);
+    if (manData == nullptr) return;
+    perfCount(perf.victronAdverts);
+    
+    BLEAddress address = advertisedDevice.getAddress();
+    const byte* mac = *address.getNative();
+#if MESH_ROLE == MESH_SCANNER
+    meshForward(mac, advertisedDevice.getRSSI(), manData, manDataSize);
+#endif
+    uint32_t lookupStart = perfNow();
+    int deviceIndex = findDeviceByMac(mac);
+    perfRecord(PERF_LOOKUP, lookupStart);
+    if (deviceIndex == -1) perfCount(perf.unknownMacs);
+    // Unknown MACs are forwarded once so the worker can log them
+    if (deviceIndex == -1 && !rememberUnknownMac(mac)) return;
     
-    int rssi = advertisedDevice.getRSSI();
+    rawPacket* pkt = packetQueueReserve(packetQueue);
+    if (pkt == nullptr) return;
     
-    // Process based on configured device type (ignore record type for Battery Sense)
-    switch (victronDevices[deviceIndex].deviceType) {
-      case DEVICE_SOLAR_CHARGER:
-        if (vicData->victronRecordType == VICTRON_TYPE_SOLAR_CHARGER) {
-          processSolarCharger(outputData, deviceIndex, rssi, deviceName);
-          packetReceived = true;
-        }
+    if (manDataSize > MANUFACTURER_DATA_MAX) manDataSize = MANUFACTURER_DATA_MAX;
+    memset(pkt->data, 0, sizeof(pkt->data));
+    memcpy(pkt->data, manData, manDataSize);
+    pkt->length = manDataSize;
+    memcpy(pkt->mac, mac, 6);
+    pkt->rssi = advertisedDevice.getRSSI();
+    pkt->deviceIndex = deviceIndex;
+    pkt->source = 0;
+    uint32_t depth = packetQueueCommit(packetQueue);
+    if (depth > perf.queueHighWater) perf.queueHighWater = depth;
+    
+    if (workerTaskHandle) xTaskNotifyGive(workerTaskHandle);
+  }
+};
+
+// ============================================================================
+// Scan Scheduler
+// ============================================================================
+// Victron devices re-broadcast each reading until it changes, so one frame
+// per nonce is all we need. Once every active device has a learned update
+// period, the radio only listens from SCAN_GUARD_MS before a device is due
+// until every due device has reported; in between the scan is stopped. A
+// device that misses SCAN_MAX_MISSES windows in a row, a new device, or the
+// periodic search for silent ones puts the scan back to continuous.
+enum ScanState { SCAN_CONTINUOUS, SCAN_IDLE, SCAN_WINDOW };
+
+struct {
+  ScanState state;
+  bool adaptive;
+  bool active;                        // Active scan (scan requests) or passive
+  uint32_t stateSinceMs;
+  uint32_t lastSearchMs;
+  uint32_t onSinceMs;                 // Scan running since, for the duty figure
+  uint32_t onTotalMs;
+  uint32_t seenUpdateMs[MAX_DEVICES]; // lastUpdateMs the schedule is based on
+  uint32_t expectedMs[MAX_DEVICES];   // When the next reading is due
+  uint8_t misses[MAX_DEVICES];
+} scanScheduler = { SCAN_CONTINUOUS, SCAN_ADAPTIVE, SCAN_ACTIVE };
+
+const char* const scanStateNames[] = { "continuous", "idle", "window" };
+
+// Called from the BLE task if the scan ever ends (e.g. stack error);
+// the scheduler restarts it without blocking.
+void scanCompleteCB(BLEScanResults results) {
+  scanRunning = false;
+}
+
+void startScan() {
+  if (scanRunning) return;
+  pBLEScan->setActiveScan(scanScheduler.active);
+  pBLEScan->clearResults();
+  scanRunning = pBLEScan->start(SCAN_DURATION_FOREVER, scanCompleteCB, false);
+  if (!scanRunning) {
+    logPrintf(LOG_LEVEL_WARN, "[SCAN] start failed, retrying\n");
+    return;
+  }
+  scanScheduler.onSinceMs = millis();
+}
+
+void stopScan() {
+  if (!scanRunning) return;
+  pBLEScan->stop();
+  scanRunning = false;
+  scanScheduler.onTotalMs += millis() - scanScheduler.onSinceMs;
+}
+
+void setScanState(ScanState state) {
+  if (state == scanScheduler.state) return;
+  logPrintf(LOG_LEVEL_DEBUG, "[SCAN] %s -> %s\n", scanStateNames[scanScheduler.state], scanStateNames[state]);
+  scanScheduler.state = state;
+  scanScheduler.stateSinceMs = millis();
+}
+
+// Readings of this device are worth waiting for
+bool scanTracks(int deviceIndex, uint32_t now) {
+  return !deviceStore.retired[deviceIndex] && deviceHasData(deviceIndex) &&
+         now - deviceStore.lastUpdateMs[deviceIndex] < SCAN_OFFLINE_MS;
+}
+
+// Follows the worker's readings; false if some tracked device has no period yet
+bool refreshScanSchedule(uint32_t now) {
+  bool synced = true;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (!scanTracks(i, now)) continue;
+    // Windows only pay off if they catch the readings
+    if (deviceStore.periodSamples[i] < SCAN_SYNC_UPDATES || linkLossPermille(i) > SCAN_LOSS_MAX_PERMILLE) synced = false;
+    uint32_t update = deviceStore.lastUpdateMs[i];
+    if (update != scanScheduler.seenUpdateMs[i]) {
+      scanScheduler.seenUpdateMs[i] = update;
+      scanScheduler.expectedMs[i] = update + deviceStore.updatePeriodMs[i];
+      scanScheduler.misses[i] = 0;
+    }
+  }
+  return synced;
+}
+
+bool scanDue(int deviceIndex, uint32_t at) {
+  return (int32_t)(at + SCAN_GUARD_MS - scanScheduler.expectedMs[deviceIndex]) >= 0;
+}
+
+// Milliseconds until the first tracked device is due (0 if one already is)
+uint32_t scanTimeToNextDue(uint32_t now) {
+  int32_t next = SCAN_OFFLINE_MS;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (!scanTracks(i, now)) continue;
+    int32_t wait = (int32_t)(scanScheduler.expectedMs[i] - SCAN_GUARD_MS - now);
+    if (wait < next) next = wait;
+  }
+  return next > 0 ? next : 0;
+}
+
+// Called from loop()
+void serviceScanScheduler() {
+  uint32_t now = millis();
+  bool synced = refreshScanSchedule(now);
+  uint32_t inState = now - scanScheduler.stateSinceMs;
+  
+  switch (scanScheduler.state) {
+    case SCAN_CONTINUOUS:
+      startScan();
+      if (scanScheduler.adaptive && synced && inState >= SCAN_SEARCH_MS && scanTimeToNextDue(now) > 0) {
+        scanScheduler.lastSearchMs = now;
+        stopScan();
+        setScanState(SCAN_IDLE);
+      }
+      break;
+      
+    case SCAN_IDLE:
+      if (!scanScheduler.adaptive || !synced || now - scanScheduler.lastSearchMs >= SCAN_SEARCH_EVERY_MS) {
+        setScanState(SCAN_CONTINUOUS);
+      } else if (scanTimeToNextDue(now) == 0) {
+        startScan();
+        setScanState(SCAN_WINDOW);
+      }
+      break;
+      
+    case SCAN_WINDOW: {
+      startScan();
+      if (!scanScheduler.adaptive || !synced) {
+        setScanState(SCAN_CONTINUOUS);
         break;
-        
-      case DEVICE_SMART_SHUNT:
-        if (vicData->victronRecordType == VICTRON_TYPE_BATTERY_MONITOR) {
-          processSmartShunt(outputData, deviceIndex, rssi, deviceName);
-          packetReceived = true;
+      }
+      // Done when no tracked device is due any more: each one either
+      // reported (new expectedMs) or, past the window limit, is skipped
+      bool waiting = false;
+      bool lost = false;
+      for (int i = 0; i < deviceCount(); i++) {
+        if (!scanTracks(i, now) || !scanDue(i, now)) continue;
+        if (inState < SCAN_WINDOW_MAX_MS) {
+          waiting = true;
+        } else {
+          scanScheduler.expectedMs[i] += deviceStore.updatePeriodMs[i];
+          if (++scanScheduler.misses[i] >= SCAN_MAX_MISSES) lost = true;
         }
-        break;
-        
-      case DEVICE_BATTERY_SENSE:
-        // Battery Sense - process ANY record type from this device
-        processBatterySense(outputData, deviceIndex, rssi, deviceName);
-        packetReceived = true;
-        break;
-        
-      default:
-        Serial.printf("[UNKNOWN TYPE] 0x%02X from %s\n", vicData->victronRecordType, deviceName);
-        break;
+      }
+      if (lost) {
+        logPrintf(LOG_LEVEL_INFO, "[SCAN] sync lost, scanning continuously\n");
+        setScanState(SCAN_CONTINUOUS);
+      } else if (!waiting && scanTimeToNextDue(now) >= SCAN_MIN_IDLE_MS) {
+        stopScan();
+        setScanState(SCAN_IDLE);
+      } else if (!waiting) {
+        // Next device due too soon to be worth a stop/start
+        scanScheduler.stateSinceMs = now;
+      }
+      break;
     }
-    
-    // Update display
-    updateDisplay();
   }
-};
+}
+
+// Serial: scan [adaptive|continuous|active|passive]
+void scanCommand(const char* arg) {
+  if (arg != nullptr && strcmp(arg, "adaptive") == 0) scanScheduler.adaptive = true;
+  if (arg != nullptr && strcmp(arg, "continuous") == 0) scanScheduler.adaptive = false;
+  if (arg != nullptr && (strcmp(arg, "active") == 0 || strcmp(arg, "passive") == 0)) {
+    scanScheduler.active = strcmp(arg, "active") == 0;
+    stopScan();  // The mode only applies to a new scan; the scheduler restarts it
+  }
+  
+  // Radio duty since the last report
+  static uint32_t reportedAtMs = 0;
+  uint32_t now = millis();
+  uint32_t onMs = scanScheduler.onTotalMs + (scanRunning ? now - scanScheduler.onSinceMs : 0);
+  static uint32_t reportedOnMs = 0;
+  uint32_t spanMs = now - reportedAtMs;
+  logPrintf(LOG_LEVEL_ERROR, "[SCAN] %s %s, now %s, radio on %u%% of the last %us\n",
+    scanScheduler.adaptive ? "adaptive" : "continuous", scanScheduler.active ? "active" : "passive",
+    scanStateNames[scanScheduler.state], spanMs ? (onMs - reportedOnMs) * 100 / spanMs : 0, spanMs / 1000);
+  reportedAtMs = now;
+  reportedOnMs = onMs;
+  
+  for (int i = 0; i < deviceCount(); i++) {
+    logPrintf(LOG_LEVEL_ERROR, "[SCAN] [%d] %-15s period:%ums samples:%d%s\n", i, device(i).comment,
+      deviceStore.updatePeriodMs[i], deviceStore.periodSamples[i], scanTracks(i, now) ? "" : " (not tracked)");
+  }
+}
 
 // ============================================================================
-// Setup
+// Buttons
 // ============================================================================
-void setup() {
-  Serial.begin(115200);
-  delay(1000);
+// Every edge (GPIO interrupt) restarts the button's debounce timer; when it
+// fires the level has been stable for BUTTON_DEBOUNCE_MS. Presses are then
+// classified on the FreeRTOS timer task: held BUTTON_LONG_MS is a long
+// press, a second press within BUTTON_DOUBLE_MS of the release a double
+// press. Buttons without a double action report short presses on release.
+// Gestures go through a single-producer / single-consumer ring to loop(),
+// so input latency does not depend on scanning or on the loop period.
+#define BUTTON_DEBOUNCE_MS      30
+#define BUTTON_LONG_MS          800
+#define BUTTON_DOUBLE_MS        250
+#define BUTTON_EVENT_QUEUE_SIZE 8     // Must be a power of two
+
+enum ButtonGesture { BUTTON_SHORT, BUTTON_DOUBLE, BUTTON_LONG };
+const char* const buttonGestureNames[] = { "short", "double", "long" };
+
+typedef struct {
+  uint8_t button;                     // Index in buttons[]
+  uint8_t gesture;                    // ButtonGesture
+} buttonEvent;
+
+struct buttonInput {
+  const char* name;
+  uint8_t pin;
+  bool hasDouble;                     // Wait for a second press before SHORT
+  TimerHandle_t debounceTimer;        // Restarted by every edge
+  TimerHandle_t gestureTimer;         // Long press while held, double window after release
+  volatile bool down;                 // Debounced level, timer task only writes
+  volatile uint8_t presses;           // Presses in the current gesture
+  bool longSent;
+};
+
+buttonInput buttons[] = {
+#if defined BUTTON_1
+  { "A", BUTTON_1, true },
+#endif
+#if defined BUTTON_2
+  { "B", BUTTON_2, false },
+#endif
+};
+const int buttonCount = sizeof(buttons) / sizeof(buttons[0]);
+
+struct {
+  buttonEvent slots[BUTTON_EVENT_QUEUE_SIZE];
+  std::atomic<uint32_t> head;         // Timer task
+  std::atomic<uint32_t> tail;         // loop()
+} buttonEvents;
+
+// Producer side (timer task). A full ring drops the gesture.
+void buttonEventPush(buttonInput* button, ButtonGesture gesture) {
+  uint32_t head = buttonEvents.head.load(std::memory_order_relaxed);
+  if (head - buttonEvents.tail.load(std::memory_order_acquire) >= BUTTON_EVENT_QUEUE_SIZE) return;
+  buttonEvents.slots[head & (BUTTON_EVENT_QUEUE_SIZE - 1)] = { (uint8_t)(button - buttons), (uint8_t)gesture };
+  buttonEvents.head.store(head + 1, std::memory_order_release);
+}
+
+// Consumer side (loop)
+bool buttonEventPop(buttonEvent* out) {
+  uint32_t tail = buttonEvents.tail.load(std::memory_order_relaxed);
+  if (tail == buttonEvents.head.load(std::memory_order_acquire)) return false;
+  *out = buttonEvents.slots[tail & (BUTTON_EVENT_QUEUE_SIZE - 1)];
+  buttonEvents.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Timer task: the level has been stable for BUTTON_DEBOUNCE_MS
+void buttonDebounced(TimerHandle_t timer) {
+  buttonInput* button = (buttonInput*)pvTimerGetTimerID(timer);
+  bool down = digitalRead(button->pin) == LOW;
+  if (down == button->down) return;  // Bounce that settled back
+  button->down = down;
   
-  Serial.println("\n\n========================================");
-  Serial.println("Victron BLE Multi-Device Scanner v2.0");
-  Serial.println("========================================");
-  Serial.printf("Build: %s\n", __TIMESTAMP__);
-  Serial.println();
+  if (down) {
+    button->presses++;
+    button->longSent = false;
+    xTimerChangePeriod(button->gestureTimer, pdMS_TO_TICKS(BUTTON_LONG_MS), 0);  // Also starts it
+  } else if (button->longSent) {
+    button->presses = 0;
+  } else if (!button->hasDouble || button->presses >= 2) {
+    xTimerStop(button->gestureTimer, 0);
+    buttonEventPush(button, button->presses >= 2 ? BUTTON_DOUBLE : BUTTON_SHORT);
+    button->presses = 0;
+  } else {
+    xTimerChangePeriod(button->gestureTimer, pdMS_TO_TICKS(BUTTON_DOUBLE_MS), 0);
+  }
+}
+
+// Timer task: held long enough, or the double-press window closed
+void buttonGestureTimeout(TimerHandle_t timer) {
+  buttonInput* button = (buttonInput*)pvTimerGetTimerID(timer);
+  if (button->down) {
+    if (button->presses > 1) buttonEventPush(button, BUTTON_SHORT);  // Short, then held
+    buttonEventPush(button, BUTTON_LONG);
+    button->longSent = true;
+  } else if (button->presses == 1) {
+    buttonEventPush(button, BUTTON_SHORT);
+  }
+  button->presses = 0;
+}
+
+void IRAM_ATTR buttonEdge(buttonInput* button) {
+  BaseType_t woken = pdFALSE;
+  xTimerResetFromISR(button->debounceTimer, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+#if defined BUTTON_1
+void IRAM_ATTR button1ISR() { buttonEdge(&buttons[0]); }
+#endif
+#if defined BUTTON_2
+void IRAM_ATTR button2ISR() { buttonEdge(&buttons[buttonCount - 1]); }
+#endif
 
+void initButtons() {
+  for (int i = 0; i < buttonCount; i++) {
+    buttonInput* button = &buttons[i];
+    pinMode(button->pin, INPUT_PULLUP);
+    button->debounceTimer = xTimerCreate("debounce", pdMS_TO_TICKS(BUTTON_DEBOUNCE_MS), pdFALSE, button, buttonDebounced);
+    button->gestureTimer = xTimerCreate("gesture", pdMS_TO_TICKS(BUTTON_LONG_MS), pdFALSE, button, buttonGestureTimeout);
+  }
 #if defined BUTTON_1
-  pinMode(BUTTON_1, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(BUTTON_1), button1ISR, CHANGE);
 #endif
 #if defined BUTTON_2
-  pinMode(BUTTON_2, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(BUTTON_2), button2ISR, CHANGE);
+#endif
+}
+
+// No gesture in progress or waiting for loop()
+bool buttonsIdle() {
+  for (int i = 0; i < buttonCount; i++) {
+    if (buttons[i].down || buttons[i].presses) return false;
+  }
+  return buttonEvents.head.load(std::memory_order_acquire) == buttonEvents.tail.load(std::memory_order_relaxed);
+}
+
+// ============================================================================
+// Power Manager
+// ============================================================================
+// The backlight dims after POWER_DIM_MS without a button press and switches
+// off after POWER_OFF_MS; the press that brings it back only wakes it. From
+// dimming on the CPU runs at POWER_IDLE_MHZ. With the panel off and no USB
+// power, loop() light-sleeps through the gaps the scan scheduler leaves
+// between windows and wakes for the next one or for a button. Bluedroid
+// cannot listen while the chip sleeps, so this only happens in SCAN_IDLE.
+#ifndef POWER_DIM_MS
+  #define POWER_DIM_MS          30000
+#endif
+#ifndef POWER_OFF_MS
+  #define POWER_OFF_MS          60000   // 0 = never switch the backlight off
+#endif
+#ifndef POWER_LIGHT_SLEEP
+  #define POWER_LIGHT_SLEEP     1
+#endif
+#define POWER_BACKLIGHT_FULL    12      // AXP192 ScreenBreath(), 7..12
+#define POWER_BACKLIGHT_DIM     8
+#define POWER_ACTIVE_MHZ        240
+#define POWER_IDLE_MHZ          80      // Lowest clock the BT controller allows
+#define POWER_SLEEP_MIN_MS      100     // Shorter gaps are not worth sleeping
+#define POWER_SLEEP_MARGIN_MS   20      // Wake this long before a window opens
+#define POWER_VBUS_MIN_V        4.0f    // USB connected: stay awake for the console
+
+enum PowerState { POWER_ACTIVE, POWER_DIMMED, POWER_BLANK };
+const char* const powerStateNames[] = { "active", "dimmed", "blank" };
+
+struct {
+  PowerState state;
+  uint32_t lastActivityMs;
+  bool sleepAllowed;                  // Cleared if light sleep is refused
+  uint32_t lastVbusCheckMs;
+  bool onUsb;
+} power = { POWER_ACTIVE, 0, POWER_LIGHT_SLEEP && !MQTT_BRIDGE && !MESH_ROLE, 0, true };  // Wi-Fi must stay up
+
+void setPowerState(PowerState state) {
+  if (state == power.state) return;
+  logPrintf(LOG_LEVEL_DEBUG, "[POWER] %s -> %s\n", powerStateNames[power.state], powerStateNames[state]);
+#if defined M5STICKC || defined M5STICKCPLUS
+  if (state == POWER_BLANK) {
+    displayBlanked = true;
+    M5.Axp.SetLDO2(false);
+  } else {
+    if (power.state == POWER_BLANK) M5.Axp.SetLDO2(true);
+    M5.Axp.ScreenBreath(state == POWER_ACTIVE ? POWER_BACKLIGHT_FULL : POWER_BACKLIGHT_DIM);
+  }
+#endif
+  setCpuFrequencyMhz(state == POWER_ACTIVE ? POWER_ACTIVE_MHZ : POWER_IDLE_MHZ);
+  perfClockChanged();
+  if (power.state == POWER_BLANK) {
+    displayBlanked = false;
+    requestDisplayRefresh();  // Frames were skipped while blanked
+  }
+  power.state = state;
+}
+
+// A button was pressed. Returns true if the press only woke the display.
+bool powerWake() {
+  power.lastActivityMs = millis();
+  bool wasIdle = power.state != POWER_ACTIVE;
+  setPowerState(POWER_ACTIVE);
+  return wasIdle;
+}
+
+#if POWER_LIGHT_SLEEP
+void powerLightSleep(uint32_t now) {
+  if (!power.sleepAllowed || power.state != POWER_BLANK || power.onUsb || !buttonsIdle()) return;
+  if (scanScheduler.state != SCAN_IDLE || scanRunning) return;
+  if (packetQueue.head.load(std::memory_order_acquire) != packetQueue.tail.load(std::memory_order_relaxed)) return;
+  uint32_t sleepMs = scanTimeToNextDue(now);
+  if (sleepMs < POWER_SLEEP_MIN_MS + POWER_SLEEP_MARGIN_MS) return;
+  sleepMs -= POWER_SLEEP_MARGIN_MS;
+  
+  Serial.flush();
+  esp_sleep_enable_timer_wakeup((uint64_t)sleepMs * 1000);
+  // The wake-up level also drives the pin interrupt: left enabled, the ISR
+  // would fire back to back for as long as the button is held
+  for (int i = 0; i < buttonCount; i++) {
+    gpio_intr_disable((gpio_num_t)buttons[i].pin);
+    gpio_wakeup_enable((gpio_num_t)buttons[i].pin, GPIO_INTR_LOW_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+  esp_err_t err = esp_light_sleep_start();
+  
+  // Back to both edges. A press that woke us only wakes the display, as it
+  // would have while awake: its release is swallowed like a long press'.
+  bool gpioWake = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO;
+  for (int i = 0; i < buttonCount; i++) {
+    gpio_wakeup_disable((gpio_num_t)buttons[i].pin);
+    gpio_set_intr_type((gpio_num_t)buttons[i].pin, GPIO_INTR_ANYEDGE);
+    if (gpioWake && digitalRead(buttons[i].pin) == LOW) {
+      buttons[i].down = true;
+      buttons[i].longSent = true;
+      buttons[i].presses = 0;
+    }
+    gpio_intr_enable((gpio_num_t)buttons[i].pin);
+  }
+  if (gpioWake) powerWake();
+  if (err != ESP_OK) {
+    power.sleepAllowed = false;
+    logPrintf(LOG_LEVEL_WARN, "[POWER] light sleep refused (%d), staying awake\n", err);
+  }
+}
+#endif
+
+// Called from loop()
+void servicePower() {
+  uint32_t now = millis();
+  uint32_t idleMs = now - power.lastActivityMs;
+  
+#if defined M5STICKC || defined M5STICKCPLUS
+  if (now - power.lastVbusCheckMs >= 1000) {
+    power.lastVbusCheckMs = now;
+    power.onUsb = M5.Axp.GetVBusVoltage() >= POWER_VBUS_MIN_V;
+  }
+#endif
+  
+  if (POWER_OFF_MS > 0 && idleMs >= POWER_OFF_MS) {
+    setPowerState(POWER_BLANK);
+  } else if (POWER_DIM_MS > 0 && idleMs >= POWER_DIM_MS && power.state == POWER_ACTIVE) {
+    setPowerState(POWER_DIMMED);
+  }
+  
+#if POWER_LIGHT_SLEEP
+  powerLightSleep(now);
+#endif
+}
+
+// ============================================================================
+// Serial Commands
+// ============================================================================
+// One command per line, e.g. "log debug". Polled from loop().
+#define SERIAL_CMD_MAX  64
+
+void handleCommand(char* line) {
+  char* cmd = strtok(line, " ");
+  char* arg = strtok(nullptr, " ");
+  char* arg2 = strtok(nullptr, " ");
+  char* arg3 = strtok(nullptr, " ");
+  char* arg4 = strtok(nullptr, " ");
+  if (cmd == nullptr) return;
+  
+  if (strcmp(cmd, "log") == 0) {
+    for (uint8_t i = 0; arg != nullptr && i <= LOG_LEVEL_DEBUG; i++) {
+      if (strcmp(arg, logLevelNames[i]) == 0) logLevel = i;
+    }
+    logPrintf(LOG_LEVEL_ERROR, "[CMD] log level: %s\n", logLevelNames[logLevel]);
+  } else if (strcmp(cmd, "telemetry") == 0) {
+    if (arg != nullptr && strcmp(arg, "text") == 0) telemetryMode = TELEMETRY_TEXT;
+    if (arg != nullptr && strcmp(arg, "binary") == 0) telemetryMode = TELEMETRY_BINARY;
+    if (arg != nullptr && strcmp(arg, "both") == 0) telemetryMode = TELEMETRY_TEXT | TELEMETRY_BINARY;
+    logPrintf(LOG_LEVEL_ERROR, "[CMD] telemetry: %s%s\n",
+      (telemetryMode & TELEMETRY_TEXT) ? "text " : "", (telemetryMode & TELEMETRY_BINARY) ? "binary" : "");
+  } else if (strcmp(cmd, "days") == 0) {
+    printDailyRecords();
+  } else if (strcmp(cmd, "add") == 0) {
+    provisionAdd(arg, arg2, arg3, arg4);
+  } else if (strcmp(cmd, "del") == 0) {
+    provisionDelete(arg);
+  } else if (strcmp(cmd, "devices") == 0) {
+    provisionList();
+  } else if (strcmp(cmd, "scan") == 0) {
+    scanCommand(arg);
+  } else if (strcmp(cmd, "link") == 0) {
+    linkCommand();
+  } else if (strcmp(cmd, "perf") == 0) {
+    perfCommand(arg);
+  } else if (strcmp(cmd, "capture") == 0) {
+    captureCommand(arg);
+#if MQTT_BRIDGE
+  } else if (strcmp(cmd, "mqtt") == 0) {
+    mqttCommand();
+#endif
+#if MESH_ROLE
+  } else if (strcmp(cmd, "mesh") == 0) {
+    meshCommand();
 #endif
+  } else {
+    logPrintf(LOG_LEVEL_ERROR, "[CMD] unknown '%s' - commands: log <error|warn|info|debug>, "
+      "telemetry <text|binary|both>, days, devices, add <mac> <key> <type> [name], del <mac>, scan [adaptive|continuous|active|passive], link, perf [reset], "
+      "capture [serial|flash|off|dump|erase]\n", cmd);
+  }
+}
+
+void pollSerialCommands() {
+  static char line[SERIAL_CMD_MAX];
+  static int len = 0;
+  
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      if (len > 0) {
+        line[len] = 0;
+        handleCommand(line);
+        len = 0;
+      }
+    } else if (len < SERIAL_CMD_MAX - 1) {
+      line[len++] = c;
+    }
+  }
+}
 
+// ============================================================================
+// Setup
+// ============================================================================
+// Runs on the other core while setup() brings up BLE: panel init and the
+// splash are ~200 ms of SPI/I2C that the first scan does not need to wait for
+void splashTask(void* param) {
 #if defined M5STICKC || defined M5STICKCPLUS
-  M5.begin();
+  M5.begin(true, true, false);  // Serial is already running
   display.init();
   display.setRotation(displayRotation);
   display.fillScreen(COLOR_BACKGROUND);
   display.setTextColor(COLOR_TEXT, COLOR_BACKGROUND);
-  #if defined M5STICKC
-    display.setTextSize(2);
-  #else
-    display.setTextSize(3);
-  #endif
+  display.setTextSize(DISPLAY_TEXT_SIZE);
   display.setTextFont(1);
   display.setCursor(0, 0);
   display.println("Victron");
   display.println("Scanner");
   display.println("v2.0");
+  display.printf("Dev:%d\n", deviceCount());
+  initFrameBuffer();
 #endif
+  xTaskNotifyGive((TaskHandle_t)param);
+  vTaskDelete(nullptr);
+}
+
+void setup() {
+  Serial.begin(115200);
+  perfClockChanged();
+  startLogger();
+  
+  logPrintf(LOG_LEVEL_INFO, "\n\n========================================\n");
+  logPrintf(LOG_LEVEL_INFO, "Victron BLE Multi-Device Scanner v2.0\n");
+  logPrintf(LOG_LEVEL_INFO, "========================================\n");
+  logPrintf(LOG_LEVEL_INFO, "Build: %s\n\n", __TIMESTAMP__);
 
-  delay(1500);
+  initButtons();
 
-  Serial.printf("Configured devices: %d\n", victronDeviceCount);
+  xTaskCreatePinnedToCore(splashTask, "splash", 4096, xTaskGetCurrentTaskHandle(), 1, nullptr, 0);
+
+  // MACs, keys and the MAC index were built at compile time: only the AES
+  // key schedules and the enrolled devices are left before the radio listens
+  initDeviceTable();
+  loadProvisionedDevices();
+  logPrintf(LOG_LEVEL_INFO, "Configured devices: %d\n", deviceCount());
   
-  for (int i = 0; i < victronDeviceCount; i++) {
-    hexCharStrToByteArray(victronDevices[i].charMacAddr, victronDevices[i].byteMacAddr);
-    hexCharStrToByteArray(victronDevices[i].charKey, victronDevices[i].byteKey);
-    strcpy(victronDevices[i].cachedDeviceName, "(unknown)");
-    
-    const char* typeStr = "?";
-    switch (victronDevices[i].deviceType) {
-      case DEVICE_SOLAR_CHARGER: typeStr = "Solar"; break;
-      case DEVICE_SMART_SHUNT: typeStr = "Shunt"; break;
-      case DEVICE_BATTERY_SENSE: typeStr = "BattSense"; break;
+  for (int i = 0; i < deviceCount(); i++) {
+    if (i < victronDeviceCount && !initDeviceCipher(i)) {
+      logPrintf(LOG_LEVEL_ERROR, "[KEY ERROR] %s - AES key setup failed\n", device(i).comment);
     }
+    if (deviceTable[i] == &freeSlot) continue;
     
-    Serial.printf("  [%d] %-10s %-10s MAC:", i, victronDevices[i].comment, typeStr);
-    for (int j = 0; j < 6; j++) Serial.printf("%02x", victronDevices[i].byteMacAddr[j]);
-    Serial.println();
+    const char* typeStr = deviceTypeNames[device(i).deviceType];
+    const byte* mac = device(i).byteMacAddr;
+    logPrintf(LOG_LEVEL_INFO, "  [%d] %-10s %-10s MAC:%02x%02x%02x%02x%02x%02x\n", i,
+      device(i).comment, typeStr, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
   }
-  Serial.println();
-
-#if defined M5STICKC || defined M5STICKCPLUS
-  display.fillScreen(COLOR_BACKGROUND);
-  display.setCursor(0, 0);
-  display.printf("Dev:%d\n", victronDeviceCount);
-  display.println("BLE...");
-#endif
+  logPrintf(LOG_LEVEL_INFO, "\n");
+  initHistory();
 
   BLEDevice::init("");
   pBLEScan = BLEDevice::getScan();
-  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
-  pBLEScan->setActiveScan(true);
-  pBLEScan->setInterval(100);
-  pBLEScan->setWindow(99);
-
-  delay(1500);
-
-  Serial.println("Ready! Scanning for Victron devices...");
-  Serial.println("New Victron devices will be logged with their MAC address.\n");
+  // wantDuplicates = true: every advertisement is delivered, nothing is cached
+  // shouldParse = false: onResult filters the raw payload itself
+  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks(), true, false);
+  pBLEScan->setInterval(SCAN_INTERVAL_MS);
+  pBLEScan->setWindow((MQTT_BRIDGE || MESH_ROLE) ? SCAN_WINDOW_COEX_MS : SCAN_WINDOW_MS);
+  // Advertisements queue up in the packet ring until the worker runs
+  startScan();
+  
+  logPrintf(LOG_LEVEL_INFO, "Ready! Scanning for Victron devices...\n");
+  logPrintf(LOG_LEVEL_INFO, "New Victron devices will be logged with their MAC address.\n\n");
 
-#if defined M5STICKC || defined M5STICKCPLUS
-  display.fillScreen(COLOR_BACKGROUND);
-  display.setCursor(0, 0);
-  display.println("Ready!");
+  // The worker draws, so the panel must be up first
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  xTaskCreatePinnedToCore(packetWorkerTask, "victronWorker", WORKER_STACK_SIZE,
+                          nullptr, WORKER_PRIORITY, &workerTaskHandle, WORKER_CORE);
+#if MESH_ROLE
+  // Forwarded readings go straight to the worker, so it must exist
+  startMesh();
+#endif
+#if MQTT_BRIDGE
+  // Last: association and DHCP take seconds and must not hold up the scan
+  startMqttBridge();
 #endif
-
-  delay(1000);
 }
 
 // ============================================================================
 // Loop
 // ============================================================================
-void loop() {
-  BLEScanResults foundDevices = pBLEScan->start(scanTime, false);
-  pBLEScan->clearResults();
-
+// A: short = next page, double = previous page, long = diagnostics page
+// B: short = rotate display, long = display off now
+void handleButtonEvent(buttonEvent event) {
+  logPrintf(LOG_LEVEL_DEBUG, "[BUTTON] %s %s\n", buttons[event.button].name, buttonGestureNames[event.gesture]);
+  
+  bool mainButton = false;
 #if defined BUTTON_1
-  // Main button - change display page
-  if (digitalRead(BUTTON_1) == LOW) {
-    while (digitalRead(BUTTON_1) == LOW) delay(50);
-    displayPage = (displayPage + 1) % 2;
-    Serial.printf("Display page: %d\n", displayPage);
-    updateDisplay();
-  }
+  mainButton = buttons[event.button].pin == BUTTON_1;
 #endif
-
-#if defined BUTTON_2
-  // Side button - rotate display
-  if (digitalRead(BUTTON_2) == LOW) {
-    while (digitalRead(BUTTON_2) == LOW) delay(50);
+  if (mainButton) {
+    // From the diagnostics page, short goes to the first page
+    if (event.gesture == BUTTON_SHORT) displayPage = (displayPage + 1) % displayPageCount();
+    if (event.gesture == BUTTON_DOUBLE) displayPage = (max(displayPage, 0) + displayPageCount() - 1) % displayPageCount();
+    if (event.gesture == BUTTON_LONG) displayPage = PAGE_DIAGNOSTICS;
+    logPrintf(LOG_LEVEL_INFO, "Display page: %d\n", displayPage);
+    requestDisplayRefresh();
+  } else if (event.gesture == BUTTON_LONG) {
+    setPowerState(POWER_BLANK);
+  } else {
     displayRotation = (displayRotation == 3) ? 1 : 3;
-    Serial.printf("Display rotation: %d\n", displayRotation);
-    display.setRotation(displayRotation);
-    updateDisplay();
+    logPrintf(LOG_LEVEL_INFO, "Display rotation: %d\n", displayRotation);
+    requestDisplayRefresh();
   }
+}
+
+void loop() {
+  serviceScanScheduler();
+  pollSerialCommands();
+  serviceStorage();
+  storageServiceDays();
+  serviceCapture();
+#if MESH_ROLE == MESH_SCANNER
+  serviceMesh();
 #endif
 
+  buttonEvent event;
+  while (buttonEventPop(&event)) {
+    // A press while the display is dimmed or off only wakes it
+    if (!powerWake()) handleButtonEvent(event);
+  }
+
   time_t timeNow = time(nullptr);
   if (!packetReceived && timeNow != lastTick) {
     lastTick = timeNow;
-    Serial.println("Scanning...");
-    updateDisplay();
+    logPrintf(LOG_LEVEL_INFO, "Scanning...\n");
+    requestDisplayRefresh();
   }
+
+  servicePower();
+  delay(LOOP_POLL_MS);
 }